@@ -0,0 +1,116 @@
+// Reformats a generated JSON array of records, comparing the streaming
+// (lazy) frontend against parsing the whole document before rendering.
+//
+//     json_bench [records] [width]
+
+#include "io.h"
+#include "json.h"
+#include "pretty.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory_resource>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace pretty;
+
+namespace {
+
+// Tracks how many bytes are live, so we can report the high-water mark.
+class measuring_resource : public std::pmr::memory_resource
+{
+public:
+    size_t live = 0;
+    size_t peak = 0;
+
+private:
+    void* do_allocate(size_t bytes, size_t align) override
+    {
+        live += bytes;
+        peak = std::max(peak, live);
+        return std::pmr::new_delete_resource()->allocate(bytes, align);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t align) override
+    {
+        live -= bytes;
+        std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const
+    noexcept override
+    {
+        return this == &other;
+    }
+};
+
+std::string make_input(long records)
+{
+    std::string input = "[";
+
+    for (long i = 0; i < records; ++i) {
+        if (i > 0) input += ",";
+        input += "{\"id\": " + std::to_string(i) +
+                 ", \"name\": \"record number " + std::to_string(i) + "\"" +
+                 ", \"score\": " + std::to_string(i % 977) + ".25" +
+                 ", \"tags\": [\"alpha\", \"beta\", \"gamma\"]" +
+                 ", \"nested\": {\"ok\": true, \"list\": [1, 2, 3, 4]}}";
+    }
+
+    return input + "]";
+}
+
+void run(const char* name, const std::string& input, int width, bool lazy,
+         int out_fd)
+{
+    measuring_resource memory;
+    auto start = std::chrono::steady_clock::now();
+
+    {
+        memory_resource_scope scope(&memory);
+
+        json_options options;
+        options.lazy = lazy;
+
+        document doc = json_document(input, options);
+
+        fd_output output(out_fd);
+        no_annotation_renderer<fd_output> renderer(output);
+        doc.render(renderer, width);
+    }
+
+    std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+
+    std::printf("%-8s %8.3f s %8.1f MB/s   peak document memory %10zu bytes\n",
+                name, elapsed.count(),
+                double(input.size()) / 1e6 / elapsed.count(),
+                memory.peak);
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    long records = argc > 1 ? std::atol(argv[1]) : 200000;
+    int width = argc > 2 ? std::atoi(argv[2]) : 80;
+
+    std::string input = make_input(records);
+    std::printf("input: %zu bytes, width %d\n", input.size(), width);
+
+    int null_fd = ::open("/dev/null", O_WRONLY);
+    if (null_fd < 0) {
+        std::perror("/dev/null");
+        return 1;
+    }
+
+    run("eager", input, width, false, null_fd);
+    run("lazy", input, width, true, null_fd);
+
+    ::close(null_fd);
+}
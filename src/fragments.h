@@ -0,0 +1,349 @@
+#pragma once
+
+#include "pretty.h"
+
+#include <cstddef>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+/// Document fragments whose shape is known at compile time, such as
+/// `"f("_doc + args + ")"_doc`. A fragment is a small value whose type
+/// records its structure; it can be lowered into a document or rendered
+/// directly. Fragments are built from `_doc` literals, `line`,
+/// `line_break`, `ref` and `view` with `+`, `group` and `nest`.
+///
+/// Each fragment type has `nodes`, an upper bound on the nodes it lowers
+/// to, and `literal_width()`, the flat width of its literals and line
+/// breaks alone, not counting `ref`s and `view`s. Lowering folds each run
+/// of adjacent literals into one text node whose width is the run's
+/// `literal_width()`.
+namespace pretty::fragments {
+
+/// A line break, which is a space when flat.
+template <bool NoSpace>
+struct line_t
+{
+    static constexpr size_t nodes = 1;
+    constexpr size_t literal_width() const { return NoSpace ? 0 : 1; }
+};
+
+/// Line breaks that are a space or nothing when flat.
+inline constexpr line_t<false> line {};
+inline constexpr line_t<true> line_break {};
+
+/// Two fragments, one after the other.
+template <class First, class Second>
+struct cat_t
+{
+    First first;
+    Second second;
+
+    static constexpr size_t nodes = 1 + First::nodes + Second::nodes;
+    constexpr size_t literal_width() const
+    {
+        return first.literal_width() + second.literal_width();
+    }
+};
+
+/// A fragment laid out flat if it fits.
+template <class Inner>
+struct group_t
+{
+    Inner inner;
+
+    static constexpr size_t nodes = 1 + Inner::nodes;
+    constexpr size_t literal_width() const { return inner.literal_width(); }
+};
+
+/// A fragment whose broken lines are indented further.
+template <class Inner>
+struct nest_t
+{
+    int amount;
+    Inner inner;
+
+    static constexpr size_t nodes = 1 + Inner::nodes;
+    constexpr size_t literal_width() const { return inner.literal_width(); }
+};
+
+/// A document supplied at run time, shared rather than copied, so it must
+/// outlive whatever the fragment is lowered into.
+template <class Annot>
+struct ref_t
+{
+    const annotated_document<Annot>* document;
+
+    static constexpr size_t nodes = 0;
+    constexpr size_t literal_width() const { return 0; }
+};
+
+/// Borrowed text supplied at run time.
+struct view_t
+{
+    std::string_view text;
+
+    static constexpr size_t nodes = 1;
+    constexpr size_t literal_width() const { return 0; }
+};
+
+/// Literal text, as made by `_doc`.
+struct literal_t
+{
+    text_literal literal;
+
+    static constexpr size_t nodes = 1;
+    constexpr size_t literal_width() const { return literal.size; }
+};
+
+/// Whether `T` is a fragment, or a `text_literal`, which acts as one.
+template <class T> struct is_fragment : std::false_type {};
+template <> struct is_fragment<text_literal> : std::true_type {};
+template <> struct is_fragment<literal_t> : std::true_type {};
+template <> struct is_fragment<view_t> : std::true_type {};
+template <bool B> struct is_fragment<line_t<B>> : std::true_type {};
+template <class A, class B> struct is_fragment<cat_t<A, B>> : std::true_type {};
+template <class A> struct is_fragment<group_t<A>> : std::true_type {};
+template <class A> struct is_fragment<nest_t<A>> : std::true_type {};
+template <class A> struct is_fragment<ref_t<A>> : std::true_type {};
+
+template <class T>
+inline constexpr bool is_fragment_v = is_fragment<std::decay_t<T>>::value;
+
+namespace detail {
+
+// Fragments as stored: literals are wrapped.
+template <class T>
+constexpr auto as_fragment(const T& t)
+{
+    if constexpr (std::is_same_v<T, text_literal>) return literal_t{t};
+    else return t;
+}
+
+template <class T>
+using fragment_t = decltype(as_fragment(std::declval<T>()));
+
+template <class T> struct is_cat : std::false_type {};
+template <class A, class B> struct is_cat<cat_t<A, B>> : std::true_type {};
+template <class T> struct is_group : std::false_type {};
+template <class A> struct is_group<group_t<A>> : std::true_type {};
+template <class T> struct is_nest : std::false_type {};
+template <class A> struct is_nest<nest_t<A>> : std::true_type {};
+
+// Whether `T` is made of literals alone.
+template <class T> struct is_text_run : std::false_type {};
+template <> struct is_text_run<literal_t> : std::true_type {};
+template <class A, class B>
+struct is_text_run<cat_t<A, B>>
+        : std::bool_constant<is_text_run<A>::value && is_text_run<B>::value> {};
+
+// Lowers a sequence of fragments, folding each run of adjacent literals
+// into a single text node. A run of one literal stays borrowed.
+template <class Annot>
+class lowering
+{
+public:
+    using document_type = annotated_document<Annot>;
+
+    template <class F>
+    void add(const F&);
+
+    document_type finish() &&;
+
+private:
+    void append_(document_type);
+    void flush_();
+    void literal_(text_literal);
+
+    template <class F>
+    void literals_(const F&);
+
+    std::optional<document_type> result_;
+    std::optional<text_literal> first_;
+    std::optional<std::pmr::string> run_;
+    size_t width_ = 0;
+};
+
+}
+
+/// Concatenates two fragments.
+template <class A, class B,
+          class = std::enable_if_t<is_fragment_v<A> && is_fragment_v<B>>>
+constexpr auto operator+(const A& a, const B& b)
+{
+    return cat_t<detail::fragment_t<A>, detail::fragment_t<B>>{
+            detail::as_fragment(a), detail::as_fragment(b)};
+}
+
+}
+
+namespace pretty::literals {
+
+/// Concatenates `_doc` literals as fragments, for when neither operand is
+/// from `pretty::fragments`.
+using fragments::operator+;
+
+}
+
+namespace pretty::fragments {
+
+/// Groups a fragment.
+template <class A, class = std::enable_if_t<is_fragment_v<A>>>
+constexpr auto group(const A& a)
+{
+    return group_t<detail::fragment_t<A>>{detail::as_fragment(a)};
+}
+
+/// Nests a fragment.
+template <class A, class = std::enable_if_t<is_fragment_v<A>>>
+constexpr auto nest(int amount, const A& a)
+{
+    return nest_t<detail::fragment_t<A>>{amount, detail::as_fragment(a)};
+}
+
+/// Refers to a run-time document.
+template <class Annot>
+constexpr ref_t<Annot> ref(const annotated_document<Annot>& doc)
+{
+    return ref_t<Annot>{&doc};
+}
+
+/// Refers to run-time text.
+constexpr view_t view(std::string_view text)
+{
+    return view_t{text};
+}
+
+/// Lowers a fragment into a document, making one node per run of adjacent
+/// literals, line, `view` and combinator, and none for `ref`s.
+template <class Annot = void, class F>
+annotated_document<Annot> lower(const F& fragment);
+
+/// Renders a fragment to a generic renderer. The fragment is lowered into
+/// an arena on the stack sized from its type, which render scratch space
+/// also comes from, so nothing is allocated on the heap unless the
+/// fragment's `ref`s are large.
+template <class Annot = void, class F, class Renderer>
+void render(const F& fragment, Renderer& out, int width);
+
+/////
+///// IMPLEMENTATION
+/////
+
+namespace detail {
+
+template <class Annot>
+template <class F>
+void lowering<Annot>::add(const F& f)
+{
+    if constexpr (is_text_run<F>::value) {
+        width_ += f.literal_width();
+        literals_(f);
+    } else if constexpr (is_cat<F>::value) {
+        add(f.first);
+        add(f.second);
+    } else {
+        flush_();
+
+        if constexpr (std::is_same_v<F, view_t>) {
+            append_(document_type::view(f.text));
+        } else if constexpr (std::is_same_v<F, line_t<false>>) {
+            append_(document_type::line(false));
+        } else if constexpr (std::is_same_v<F, line_t<true>>) {
+            append_(document_type::line(true));
+        } else if constexpr (std::is_same_v<F, ref_t<Annot>>) {
+            append_(f.document->share());
+        } else if constexpr (is_group<F>::value) {
+            append_(lower<Annot>(f.inner).group());
+        } else {
+            static_assert(is_nest<F>::value, "not a fragment");
+            append_(lower<Annot>(f.inner).nest(f.amount));
+        }
+    }
+}
+
+template <class Annot>
+template <class F>
+void lowering<Annot>::literals_(const F& f)
+{
+    if constexpr (std::is_same_v<F, literal_t>) {
+        literal_(f.literal);
+    } else {
+        literals_(f.first);
+        literals_(f.second);
+    }
+}
+
+template <class Annot>
+void lowering<Annot>::literal_(text_literal literal)
+{
+    if (!first_ && !run_) {
+        first_ = literal;
+        return;
+    }
+
+    if (first_) {
+        run_.emplace(first_->text, get_memory_resource());
+        first_.reset();
+    }
+
+    run_->append(literal.text);
+}
+
+template <class Annot>
+void lowering<Annot>::flush_()
+{
+    if (first_) {
+        append_(document_type(*first_));
+    } else if (run_) {
+        append_(document_type::text_size(width_, std::move(*run_)));
+    }
+
+    first_.reset();
+    run_.reset();
+    width_ = 0;
+}
+
+template <class Annot>
+void lowering<Annot>::append_(document_type doc)
+{
+    if (result_) *result_ = std::move(*result_).append(std::move(doc));
+    else result_.emplace(std::move(doc));
+}
+
+template <class Annot>
+auto lowering<Annot>::finish() && -> document_type
+{
+    flush_();
+    return result_ ? std::move(*result_) : document_type();
+}
+
+}
+
+template <class Annot, class F>
+annotated_document<Annot> lower(const F& fragment)
+{
+    detail::lowering<Annot> lowering;
+    lowering.add(detail::as_fragment(fragment));
+    return std::move(lowering).finish();
+}
+
+template <class Annot, class F, class Renderer>
+void render(const F& fragment, Renderer& out, int width)
+{
+    using document_type = annotated_document<Annot>;
+
+    constexpr size_t nodes = detail::fragment_t<F>::nodes;
+    alignas(std::max_align_t)
+    std::byte buffer[nodes * document_type::node_size() + 1024];
+
+    std::pmr::monotonic_buffer_resource arena(buffer, sizeof buffer,
+                                              get_memory_resource());
+    memory_resource_scope scope(&arena);
+
+    lower<Annot>(fragment).render(out, width);
+}
+
+}
@@ -0,0 +1,210 @@
+#pragma once
+
+#include "pretty.h"
+
+#include <cassert>
+#include <vector>
+
+namespace pretty {
+
+/// The lines of output changed by an edit: `removed` lines starting at
+/// line `first` (counting from 0) were replaced by `inserted` lines.
+struct line_change
+{
+    size_t first;
+    size_t removed;
+    size_t inserted;
+};
+
+/// A sequence of documents, such as the top-level declarations of a source
+/// file, rendered one after another with a line break between each, and
+/// kept laid out as they are edited. Since a line break between items
+/// always breaks, no layout decision in one item depends on another, so
+/// each item's layout is cached and an edit lays out only the items it
+/// replaces.
+///
+/// The item is the unit of reuse: items bound how far a change can
+/// reach, but a small edit inside one large item still lays out that whole
+/// item again. Split documents into items as finely as their forced breaks
+/// allow. Line numbers are kept in a Fenwick tree, so `replace`, `lines`
+/// and `first_line` take logarithmic time in the number of items; `insert`
+/// and `erase` shift the items after, as a vector does.
+template <class Annot>
+class annotated_incremental_layout
+{
+public:
+    /// The document type.
+    using document_type = annotated_document<Annot>;
+
+    /// Lays out items at the given width.
+    explicit annotated_incremental_layout(int width) : width_(width) {}
+
+    /// The number of items.
+    size_t size() const { return items_.size(); }
+
+    /// The number of lines of output.
+    size_t lines() const;
+
+    /// The width items are laid out at.
+    int width() const { return width_; }
+
+    /// The item at `index`.
+    const document_type& operator[](size_t index) const;
+
+    /// The layout of the item at `index`.
+    auto layout(size_t index) const
+        -> const typename document_type::layout_result&;
+
+    /// The line on which the item at `index` starts.
+    size_t first_line(size_t index) const;
+
+    /// Inserts an item before `index`.
+    line_change insert(size_t index, document_type);
+
+    /// Replaces the item at `index`.
+    line_change replace(size_t index, document_type);
+
+    /// Removes the item at `index`.
+    line_change erase(size_t index);
+
+    /// Renders all items to a generic renderer from their cached layouts.
+    template <class Renderer>
+    void render(Renderer&) const;
+
+private:
+    struct item_
+    {
+        document_type document;
+        typename document_type::layout_result layout;
+    };
+
+    item_ make_item_(document_type) const;
+
+    // Fenwick tree of line counts: `lines_[i]` sums the items in
+    // `(i - (i & -i), i]`, counting items from 1.
+    void add_lines_(size_t index, size_t delta);
+    void rebuild_lines_();
+
+    std::vector<item_> items_;
+    std::vector<size_t> lines_ {0};
+    int width_;
+};
+
+/// Incremental layout of unannotated documents.
+using incremental_layout = annotated_incremental_layout<void>;
+
+/////
+///// IMPLEMENTATION
+/////
+
+template <class Annot>
+auto annotated_incremental_layout<Annot>::make_item_(document_type doc) const
+        -> item_
+{
+    auto layout = doc.layout(width_);
+    return item_{std::move(doc), std::move(layout)};
+}
+
+template <class Annot>
+void annotated_incremental_layout<Annot>::add_lines_(size_t index,
+                                                     size_t delta)
+{
+    // Unsigned wraparound makes a negative `delta` work too.
+    for (size_t i = index + 1; i < lines_.size(); i += i & -i)
+        lines_[i] += delta;
+}
+
+template <class Annot>
+void annotated_incremental_layout<Annot>::rebuild_lines_()
+{
+    lines_.assign(items_.size() + 1, 0);
+
+    for (size_t i = 1; i < lines_.size(); ++i) {
+        lines_[i] += items_[i - 1].layout.lines();
+        size_t parent = i + (i & -i);
+        if (parent < lines_.size()) lines_[parent] += lines_[i];
+    }
+}
+
+template <class Annot>
+size_t annotated_incremental_layout<Annot>::lines() const
+{
+    return first_line(items_.size());
+}
+
+template <class Annot>
+auto annotated_incremental_layout<Annot>::operator[](size_t index) const
+        -> const document_type&
+{
+    assert(index < items_.size());
+    return items_[index].document;
+}
+
+template <class Annot>
+auto annotated_incremental_layout<Annot>::layout(size_t index) const
+        -> const typename document_type::layout_result&
+{
+    assert(index < items_.size());
+    return items_[index].layout;
+}
+
+template <class Annot>
+size_t annotated_incremental_layout<Annot>::first_line(size_t index) const
+{
+    assert(index <= items_.size());
+
+    size_t line = 0;
+    for (size_t i = index; i > 0; i -= i & -i)
+        line += lines_[i];
+    return line;
+}
+
+template <class Annot>
+line_change
+annotated_incremental_layout<Annot>::insert(size_t index, document_type doc)
+{
+    assert(index <= items_.size());
+
+    item_ item = make_item_(std::move(doc));
+    line_change change{first_line(index), 0, item.layout.lines()};
+    items_.insert(items_.begin() + index, std::move(item));
+    rebuild_lines_();
+    return change;
+}
+
+template <class Annot>
+line_change
+annotated_incremental_layout<Annot>::replace(size_t index, document_type doc)
+{
+    assert(index < items_.size());
+
+    item_ item = make_item_(std::move(doc));
+    line_change change{first_line(index), items_[index].layout.lines(),
+                       item.layout.lines()};
+    items_[index] = std::move(item);
+    add_lines_(index, change.inserted - change.removed);
+    return change;
+}
+
+template <class Annot>
+line_change annotated_incremental_layout<Annot>::erase(size_t index)
+{
+    assert(index < items_.size());
+
+    line_change change{first_line(index), items_[index].layout.lines(), 0};
+    items_.erase(items_.begin() + index);
+    rebuild_lines_();
+    return change;
+}
+
+template <class Annot>
+template <class Renderer>
+void annotated_incremental_layout<Annot>::render(Renderer& out) const
+{
+    for (size_t i = 0; i < items_.size(); ++i) {
+        if (i > 0) out.newline(0);
+        items_[i].layout.replay(out);
+    }
+}
+
+}
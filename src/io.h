@@ -0,0 +1,267 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+
+#include <unistd.h>
+
+namespace pretty {
+
+/// A buffered output for renderers that writes to a POSIX file descriptor.
+/// The descriptor is not closed.
+class fd_output
+{
+public:
+    /// Writes to `fd`, buffering up to `buffer_size` bytes.
+    explicit fd_output(int fd, size_t buffer_size = 1 << 16);
+
+    fd_output(const fd_output&) = delete;
+    fd_output& operator=(const fd_output&) = delete;
+
+    /// Flushes, ignoring errors.
+    ~fd_output();
+
+    /// Writes `n` bytes starting at `s`.
+    void write(const char* s, size_t n);
+
+    /// Writes out the buffer. Throws `std::system_error` on failure.
+    void flush();
+
+private:
+    int fd_;
+    size_t capacity_;
+    std::string buffer_;
+};
+
+/// Configuration for an asynchronous output.
+struct async_output_options
+{
+    /// Size of each of the two buffers.
+    size_t buffer_size = 1 << 16;
+    /// How long written data may sit in the fill buffer, provided writing
+    /// continues, before it is handed to the background thread.
+    std::chrono::milliseconds flush_latency {50};
+};
+
+/// A double-buffered output for renderers that writes to a POSIX file
+/// descriptor on a background thread. Rendering fills one buffer while the
+/// other is written out, so layout and I/O overlap. The descriptor is not
+/// closed.
+class async_fd_output
+{
+public:
+    /// Starts the background thread, writing to `fd`.
+    explicit async_fd_output(int fd, async_output_options = {});
+
+    async_fd_output(const async_fd_output&) = delete;
+    async_fd_output& operator=(const async_fd_output&) = delete;
+
+    /// Finishes, ignoring errors, and stops the background thread.
+    ~async_fd_output();
+
+    /// Writes `n` bytes starting at `s`. Throws `std::system_error` if an
+    /// earlier background write failed.
+    void write(const char* s, size_t n);
+
+    /// Writes out everything written so far and waits for it to complete.
+    /// Throws `std::system_error` if a background write failed.
+    void finish();
+
+private:
+    void hand_off_();
+    void wait_idle_(std::unique_lock<std::mutex>&);
+    void run_();
+
+    const int fd_;
+    const size_t capacity_;
+    const std::chrono::milliseconds latency_;
+
+    // Owned by the writing thread.
+    std::string fill_;
+
+    // Guarded by `mutex_`; `flush_` belongs to the background thread while
+    // `flush_pending_` is set.
+    std::string flush_;
+    bool flush_pending_ = false;
+    bool stopping_ = false;
+    std::exception_ptr error_;
+
+    // Set by the background thread when `fill_` has been waiting too long.
+    std::atomic<bool> latency_expired_ {false};
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread thread_;
+};
+
+/////
+///// IMPLEMENTATION
+/////
+
+namespace detail {
+
+inline void write_fully(int fd, const char* s, size_t n)
+{
+    while (n > 0) {
+        ssize_t written = ::write(fd, s, n);
+
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw std::system_error(errno, std::generic_category(),
+                                    "pretty::fd_output");
+        }
+
+        s += written;
+        n -= size_t(written);
+    }
+}
+
+}
+
+inline fd_output::fd_output(int fd, size_t buffer_size)
+        : fd_(fd), capacity_(buffer_size)
+{
+    buffer_.reserve(capacity_);
+}
+
+inline fd_output::~fd_output()
+{
+    try {
+        flush();
+    } catch (const std::system_error&) { }
+}
+
+inline void fd_output::write(const char* s, size_t n)
+{
+    if (buffer_.size() + n > capacity_) {
+        flush();
+
+        if (n >= capacity_) {
+            detail::write_fully(fd_, s, n);
+            return;
+        }
+    }
+
+    buffer_.append(s, n);
+}
+
+inline void fd_output::flush()
+{
+    detail::write_fully(fd_, buffer_.data(), buffer_.size());
+    buffer_.clear();
+}
+
+inline async_fd_output::async_fd_output(int fd, async_output_options options)
+        : fd_(fd)
+        , capacity_(std::max(size_t(1), options.buffer_size))
+        , latency_(options.flush_latency)
+{
+    fill_.reserve(capacity_);
+    flush_.reserve(capacity_);
+    thread_ = std::thread([this] { run_(); });
+}
+
+inline async_fd_output::~async_fd_output()
+{
+    try {
+        finish();
+    } catch (const std::system_error&) { }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+
+    cv_.notify_all();
+    thread_.join();
+}
+
+inline void async_fd_output::write(const char* s, size_t n)
+{
+    if (latency_expired_.load(std::memory_order_relaxed) && !fill_.empty())
+        hand_off_();
+
+    while (n > 0) {
+        size_t amount = std::min(n, capacity_ - fill_.size());
+        fill_.append(s, amount);
+        s += amount;
+        n -= amount;
+
+        if (fill_.size() == capacity_) hand_off_();
+    }
+}
+
+inline void async_fd_output::finish()
+{
+    if (!fill_.empty()) hand_off_();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    wait_idle_(lock);
+}
+
+inline void async_fd_output::wait_idle_(std::unique_lock<std::mutex>& lock)
+{
+    cv_.wait(lock, [this] { return !flush_pending_; });
+
+    if (error_) {
+        std::exception_ptr error = error_;
+        error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+inline void async_fd_output::hand_off_()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    wait_idle_(lock);
+
+    fill_.swap(flush_);
+    flush_pending_ = true;
+    latency_expired_.store(false, std::memory_order_relaxed);
+
+    lock.unlock();
+    cv_.notify_all();
+}
+
+inline void async_fd_output::run_()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    for (;;) {
+        bool woken = cv_.wait_for(lock, latency_, [this] {
+            return flush_pending_ || stopping_;
+        });
+
+        if (flush_pending_) {
+            lock.unlock();
+
+            std::exception_ptr error;
+            try {
+                detail::write_fully(fd_, flush_.data(), flush_.size());
+            } catch (const std::system_error&) {
+                error = std::current_exception();
+            }
+
+            lock.lock();
+            flush_.clear();
+            flush_pending_ = false;
+            if (error && !error_) error_ = error;
+            cv_.notify_all();
+        } else if (stopping_) {
+            return;
+        } else if (!woken) {
+            latency_expired_.store(true, std::memory_order_relaxed);
+        }
+    }
+}
+
+}
@@ -0,0 +1,361 @@
+#pragma once
+
+#include "pretty.h"
+
+#include <cctype>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace pretty {
+
+/// Thrown when JSON input is malformed.
+class json_error : public std::runtime_error
+{
+public:
+    json_error(const std::string& what, size_t offset)
+            : std::runtime_error(what + " at offset " + std::to_string(offset))
+            , offset_(offset)
+    { }
+
+    /// The offset in the input where the error was detected.
+    size_t offset() const { return offset_; }
+
+private:
+    size_t offset_;
+};
+
+/// Options for reformatting JSON.
+struct json_options
+{
+    /// How far to indent the contents of broken arrays and objects.
+    int indent = 2;
+
+    /// Whether to parse incrementally as rendering proceeds. If false, the
+    /// whole input is parsed into a document up front.
+    bool lazy = true;
+};
+
+/// Reads a JSON value from `in` as a document in which each array and
+/// object is a group: flat if it fits, otherwise one element per line.
+/// Scalars and keys are reproduced exactly as written, escapes included.
+///
+/// By default the input is tokenized only as rendering reaches it, and
+/// each part of the document is released once rendered, so reformatting
+/// takes memory proportional to the width and nesting depth rather than
+/// the input size. The stream must then outlive the document and be left
+/// alone until rendering is done; the document can be rendered only once.
+/// Malformed input throws `json_error` from whichever call reaches it.
+template <class Annot = void>
+annotated_document<Annot> json_document(std::istream& in, json_options = {});
+
+/// Reads a JSON value from memory, for example a mapped file, which must
+/// outlive the document.
+template <class Annot = void>
+annotated_document<Annot> json_document(std::string_view, json_options = {});
+
+/////
+///// IMPLEMENTATION
+/////
+
+namespace detail {
+
+// A read-only stream buffer over memory.
+class view_streambuf : public std::streambuf
+{
+public:
+    explicit view_streambuf(std::string_view sv)
+    {
+        char* begin = const_cast<char*>(sv.data());
+        setg(begin, begin, begin + sv.size());
+    }
+};
+
+template <class Annot>
+class json_reader : public std::enable_shared_from_this<json_reader<Annot>>
+{
+public:
+    using document_type = annotated_document<Annot>;
+
+    json_reader(std::streambuf* in, json_options options)
+            : in_(in), options_(options)
+    { }
+
+    json_reader(std::string_view sv, json_options options)
+            : owned_(std::make_unique<view_streambuf>(sv))
+            , in_(owned_.get())
+            , options_(options)
+    { }
+
+    // The whole input, which must be a single value.
+    document_type top()
+    {
+        if (!options_.lazy) {
+            document_type result = value();
+            expect_end_();
+            return result;
+        }
+
+        auto self = this->shared_from_this();
+        return document_type::lazy([self] { return self->value(); })
+                .append(document_type::lazy([self] {
+                    self->expect_end_();
+                    return document_type();
+                }));
+    }
+
+    document_type value()
+    {
+        switch (peek_()) {
+            case '[': return container_('[', ']');
+            case '{': return container_('{', '}');
+            case '"': return document_type::text(string_());
+            default:  return document_type::text(scalar_());
+        }
+    }
+
+private:
+    static constexpr int eof_ = std::char_traits<char>::eof();
+
+    void expect_end_()
+    {
+        if (peek_() != eof_) fail_("trailing characters");
+    }
+
+    // "[" + nest(elements) + line + "]", grouped.
+    document_type container_(char open, char close)
+    {
+        get_();
+
+        document_type elements;
+
+        if (options_.lazy) {
+            auto self = this->shared_from_this();
+            elements = document_type::lazy([self, close] {
+                return self->elements_(close, true);
+            });
+        } else {
+            std::vector<document_type> parts;
+            for (bool first = true; !at_end_(close, first); first = false)
+                parts.push_back(element_(close, first));
+            elements = concat_(parts, 0, parts.size());
+        }
+
+        return document_type::text(1, open)
+                .append(elements.move().nest(options_.indent))
+                .append(document_type::line(true))
+                .append(document_type::text(1, close))
+                .group();
+    }
+
+    // Appends `parts[begin, end)` as a balanced tree, so that a long array
+    // makes a document of logarithmic rather than linear depth.
+    static document_type concat_(std::vector<document_type>& parts,
+                                 size_t begin, size_t end)
+    {
+        if (end - begin == 0) return document_type();
+        if (end - begin == 1) return std::move(parts[begin]);
+
+        size_t middle = begin + (end - begin) / 2;
+        return concat_(parts, begin, middle)
+                .append(concat_(parts, middle, end));
+    }
+
+    // The next element and, lazily, the rest.
+    document_type elements_(char close, bool first)
+    {
+        if (at_end_(close, first)) return document_type();
+
+        auto self = this->shared_from_this();
+        return element_(close, first)
+                .append(document_type::lazy([self, close] {
+                    return self->elements_(close, false);
+                }));
+    }
+
+    // Consumes the closing bracket, or the separating comma.
+    bool at_end_(char close, bool first)
+    {
+        int c = peek_();
+
+        if (c == close) {
+            get_();
+            return true;
+        }
+
+        if (!first) {
+            if (c != ',') fail_(std::string("expected ',' or '") + close + "'");
+            get_();
+        }
+
+        return false;
+    }
+
+    document_type element_(char close, bool first)
+    {
+        document_type result = first
+                ? document_type::line(true)
+                : document_type::text(1, ',').append(document_type::line());
+
+        if (close == '}') {
+            if (peek_() != '"') fail_("expected key");
+            result = result.move().append(document_type::text(string_()));
+
+            if (peek_() != ':') fail_("expected ':'");
+            get_();
+            result = result.move().append(document_type::view(": "));
+        }
+
+        return result.move().append(value());
+    }
+
+    // A string, quotes and escapes included.
+    std::string string_()
+    {
+        std::string result(1, char(get_()));
+
+        for (;;) {
+            int c = string_char_(result);
+
+            if (c == '"') return result;
+            if (c < 0x20) fail_("control character in string", offset_ - 1);
+
+            if (c == '\\') {
+                c = string_char_(result);
+                if (c == 'u') {
+                    for (int i = 0; i < 4; ++i) {
+                        if (!std::isxdigit(string_char_(result)))
+                            fail_("invalid \\u escape", offset_ - 1);
+                    }
+                } else if (c == 0 || !std::strchr("\"\\/bfnrt", c)) {
+                    fail_("invalid escape", offset_ - 1);
+                }
+            }
+        }
+    }
+
+    // The next character of a string, appended to `result`.
+    int string_char_(std::string& result)
+    {
+        int c = in_->sbumpc();
+        ++offset_;
+
+        if (c == eof_) fail_("unterminated string");
+        result += char(c);
+        return c;
+    }
+
+    // A number, `true`, `false` or `null`.
+    std::string scalar_()
+    {
+        size_t start = offset_;
+        std::string result;
+
+        for (int c = peek_(); ; c = in_->sgetc()) {
+            bool word = c != eof_ && (std::isalnum(c) || c == '-' ||
+                                      c == '+' || c == '.');
+            if (!word) break;
+
+            result += char(c);
+            in_->sbumpc();
+            ++offset_;
+        }
+
+        if (result.empty()) fail_("expected value");
+
+        bool valid = result == "true" || result == "false" ||
+                     result == "null" || is_number_(result);
+        if (!valid) fail_("invalid value '" + result + "'", start);
+
+        return result;
+    }
+
+    // -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+    static bool is_number_(std::string_view s)
+    {
+        size_t i = 0;
+        auto digits = [&] {
+            size_t first = i;
+            while (i < s.size() && std::isdigit((unsigned char) s[i])) ++i;
+            return i > first;
+        };
+
+        if (i < s.size() && s[i] == '-') ++i;
+
+        if (i < s.size() && s[i] == '0') {
+            ++i;
+        } else if (!digits()) {
+            return false;
+        }
+
+        if (i < s.size() && s[i] == '.') {
+            ++i;
+            if (!digits()) return false;
+        }
+
+        if (i < s.size() && (s[i] == 'e' || s[i] == 'E')) {
+            ++i;
+            if (i < s.size() && (s[i] == '+' || s[i] == '-')) ++i;
+            if (!digits()) return false;
+        }
+
+        return i == s.size();
+    }
+
+    // The next non-whitespace character, not consumed.
+    int peek_()
+    {
+        for (;;) {
+            int c = in_->sgetc();
+            if (c != ' ' && c != '\n' && c != '\r' && c != '\t') return c;
+            in_->sbumpc();
+            ++offset_;
+        }
+    }
+
+    int get_()
+    {
+        int c = peek_();
+        in_->sbumpc();
+        ++offset_;
+        return c;
+    }
+
+    [[noreturn]] void fail_(const std::string& what) const
+    {
+        fail_(what, offset_);
+    }
+
+    [[noreturn]] static void fail_(const std::string& what, size_t offset)
+    {
+        throw json_error(what, offset);
+    }
+
+    std::unique_ptr<view_streambuf> owned_;
+    std::streambuf* in_;
+    json_options options_;
+    size_t offset_ = 0;
+};
+
+}
+
+template <class Annot>
+annotated_document<Annot> json_document(std::istream& in, json_options options)
+{
+    return std::make_shared<detail::json_reader<Annot>>(in.rdbuf(), options)
+            ->top();
+}
+
+template <class Annot>
+annotated_document<Annot> json_document(std::string_view sv,
+                                        json_options options)
+{
+    return std::make_shared<detail::json_reader<Annot>>(sv, options)->top();
+}
+
+}
@@ -0,0 +1,360 @@
+#pragma once
+
+#include "io.h"
+#include "pretty.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <variant>
+
+namespace pretty {
+
+/// What a log sink does with a record when its queue is full.
+enum class overflow_policy
+{
+    /// The producer waits for the render thread to make room.
+    block,
+    /// The record is discarded and counted in `dropped()`.
+    drop,
+};
+
+/// Configuration for a log sink.
+struct log_sink_options
+{
+    /// Maximum number of queued records, rounded up to a power of two.
+    size_t capacity = 4096;
+    /// What to do when the queue is full.
+    overflow_policy overflow = overflow_policy::block;
+    /// Size of the output buffer in front of the file descriptor.
+    size_t buffer_size = 1 << 16;
+};
+
+namespace detail {
+
+// A bounded, lock-free, multi-producer single-consumer queue (after
+// Vyukov's bounded MPMC queue). Each cell's sequence number says whether
+// it is free for the producer claiming position `pos` (seq == pos) or
+// holds the value for the consumer at `pos` (seq == pos + 1).
+template <class T>
+class mpsc_queue
+{
+public:
+    explicit mpsc_queue(size_t capacity);
+
+    // Returns false, leaving `value` alone, if the queue is full.
+    bool try_push(T& value);
+
+    // Consumer thread only.
+    std::optional<T> try_pop();
+
+    size_t size() const;
+
+private:
+    struct cell_
+    {
+        std::atomic<size_t> seq;
+        std::optional<T> value;
+    };
+
+    std::unique_ptr<cell_[]> cells_;
+    size_t mask_;
+    std::atomic<size_t> enqueue_pos_ {0};
+    std::atomic<size_t> dequeue_pos_ {0};
+};
+
+}
+
+/// A logging sink that renders documents on a dedicated thread. Any number
+/// of producer threads `push` documents, or callables that build them,
+/// into a lock-free queue; the render thread lays each one out at the
+/// sink's width and writes it, followed by a newline, to a file
+/// descriptor. Borrowed text in pushed documents must remain valid until
+/// the sink has rendered it (at the latest, until `flush` or destruction).
+template <class Annot>
+class annotated_log_sink
+{
+public:
+    /// The document type.
+    using document_type = annotated_document<Annot>;
+
+    /// A callable that builds a document on the render thread.
+    using builder_type = std::function<document_type()>;
+
+    /// Starts the render thread, writing to `fd` at the given width.
+    annotated_log_sink(int fd, int width, log_sink_options = {});
+
+    annotated_log_sink(const annotated_log_sink&) = delete;
+    annotated_log_sink& operator=(const annotated_log_sink&) = delete;
+
+    /// Renders everything queued and stops the render thread.
+    ~annotated_log_sink();
+
+    /// Queues a document. Returns false if the record was dropped.
+    bool push(document_type);
+
+    /// Queues a callable to be called on the render thread to build a
+    /// document. Returns false if the record was dropped.
+    bool push(builder_type);
+
+    /// Waits until everything pushed so far has been written out.
+    void flush();
+
+    /// The approximate number of records waiting to be rendered.
+    size_t queue_depth() const;
+
+    /// The number of records dropped because the queue was full, or because
+    /// building or rendering them threw.
+    size_t dropped() const;
+
+private:
+    using record_ = std::variant<document_type, builder_type>;
+
+    bool push_(record_);
+    void run_();
+    // Writes out the first `written` records and wakes flushers.
+    void publish_(size_t written);
+    void wake_();
+
+    detail::mpsc_queue<record_> queue_;
+    const int width_;
+    const overflow_policy overflow_;
+    fd_output output_;
+
+    std::atomic<size_t> dropped_ {0};
+    std::atomic<size_t> pushed_ {0};
+    std::atomic<size_t> written_ {0};
+    // The highest target any `flush` is waiting for.
+    std::atomic<size_t> flush_target_ {0};
+    std::atomic<bool> idle_ {false};
+    std::atomic<bool> stopping_ {false};
+
+    std::mutex mutex_;
+    std::condition_variable wake_consumer_;
+    std::condition_variable wake_flushers_;
+
+    std::thread thread_;
+};
+
+/// A log sink for unannotated documents.
+using log_sink = annotated_log_sink<void>;
+
+/////
+///// IMPLEMENTATION
+/////
+
+namespace detail {
+
+template <class T>
+mpsc_queue<T>::mpsc_queue(size_t capacity)
+{
+    size_t size = 2;
+    while (size < capacity) size *= 2;
+
+    cells_ = std::make_unique<cell_[]>(size);
+    mask_ = size - 1;
+
+    for (size_t i = 0; i < size; ++i)
+        cells_[i].seq.store(i, std::memory_order_relaxed);
+}
+
+template <class T>
+bool mpsc_queue<T>::try_push(T& value)
+{
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    cell_* cell;
+
+    for (;;) {
+        cell = &cells_[pos & mask_];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        auto diff = std::ptrdiff_t(seq) - std::ptrdiff_t(pos);
+
+        if (diff == 0) {
+            if (enqueue_pos_.compare_exchange_weak(
+                    pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = enqueue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->value.emplace(std::move(value));
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template <class T>
+std::optional<T> mpsc_queue<T>::try_pop()
+{
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    cell_& cell = cells_[pos & mask_];
+
+    if (cell.seq.load(std::memory_order_acquire) != pos + 1)
+        return std::nullopt;
+
+    std::optional<T> result(std::move(cell.value));
+    cell.value.reset();
+    dequeue_pos_.store(pos + 1, std::memory_order_relaxed);
+    cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+    return result;
+}
+
+template <class T>
+size_t mpsc_queue<T>::size() const
+{
+    size_t tail = enqueue_pos_.load(std::memory_order_relaxed);
+    size_t head = dequeue_pos_.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+}
+
+template <class Annot>
+annotated_log_sink<Annot>::annotated_log_sink(
+        int fd, int width, log_sink_options options)
+        : queue_(options.capacity)
+        , width_(width)
+        , overflow_(options.overflow)
+        , output_(fd, options.buffer_size)
+        , thread_([this] { run_(); })
+{ }
+
+template <class Annot>
+annotated_log_sink<Annot>::~annotated_log_sink()
+{
+    stopping_ = true;
+    wake_();
+    thread_.join();
+}
+
+template <class Annot>
+bool annotated_log_sink<Annot>::push(document_type doc)
+{
+    return push_(record_(std::in_place_index<0>, std::move(doc)));
+}
+
+template <class Annot>
+bool annotated_log_sink<Annot>::push(builder_type builder)
+{
+    return push_(record_(std::in_place_index<1>, std::move(builder)));
+}
+
+template <class Annot>
+bool annotated_log_sink<Annot>::push_(record_ record)
+{
+    while (!queue_.try_push(record)) {
+        if (overflow_ == overflow_policy::drop) {
+            ++dropped_;
+            return false;
+        }
+
+        wake_();
+        std::this_thread::yield();
+    }
+
+    ++pushed_;
+    if (idle_) wake_();
+    return true;
+}
+
+template <class Annot>
+void annotated_log_sink<Annot>::wake_()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    wake_consumer_.notify_one();
+}
+
+template <class Annot>
+void annotated_log_sink<Annot>::flush()
+{
+    size_t target = pushed_.load();
+
+    size_t waiting = flush_target_.load();
+    while (waiting < target &&
+           !flush_target_.compare_exchange_weak(waiting, target)) { }
+
+    wake_();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    wake_flushers_.wait(lock, [&] { return written_.load() >= target; });
+}
+
+template <class Annot>
+void annotated_log_sink<Annot>::publish_(size_t written)
+{
+    try {
+        output_.flush();
+    } catch (const std::system_error&) { }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    written_ = written;
+    wake_flushers_.notify_all();
+}
+
+template <class Annot>
+size_t annotated_log_sink<Annot>::queue_depth() const
+{
+    return queue_.size();
+}
+
+template <class Annot>
+size_t annotated_log_sink<Annot>::dropped() const
+{
+    return dropped_.load();
+}
+
+template <class Annot>
+void annotated_log_sink<Annot>::run_()
+{
+    no_annotation_renderer<fd_output> renderer(output_);
+    size_t written = 0;
+
+    for (;;) {
+        while (auto record = queue_.try_pop()) {
+            try {
+                if (auto* doc = std::get_if<document_type>(&*record)) {
+                    doc->render(renderer, width_);
+                } else {
+                    std::get<builder_type>(*record)().render(renderer, width_);
+                }
+
+                output_.write("\n", 1);
+            } catch (...) {
+                ++dropped_;
+            }
+
+            ++written;
+
+            // Under steady load the queue may never drain, so a waiting
+            // flusher is released as soon as its target is reached.
+            size_t target = flush_target_.load();
+            if (written >= target && written_.load() < target)
+                publish_(written);
+        }
+
+        // The queue is drained, so this is a good time to write out.
+        publish_(written);
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (stopping_ && queue_.size() == 0) return;
+
+            // Producers only take the lock to wake us while we're idle. The
+            // timeout covers a push that lands between the check and the
+            // wait.
+            idle_ = true;
+            if (queue_.size() == 0 && !stopping_)
+                wake_consumer_.wait_for(lock, std::chrono::milliseconds(10));
+            idle_ = false;
+        }
+    }
+}
+
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "pretty.h"
+#include "workers.h"
+
+#include <algorithm>
+#include <iterator>
+#include <memory_resource>
+#include <optional>
+#include <ostream>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+/// Pretty-printing combinators.
+namespace pretty {
+
+/// Maps `fn` over the random-access range `[first, last)` using up to
+/// `threads` worker threads (by default, one per hardware thread) and
+/// concatenates the resulting documents in order. `fn` is called
+/// concurrently and must be safe to call so. Workers other than the
+/// calling thread allocate from `std::pmr::get_default_resource()`. The
+/// per-worker results are spliced together without copying, so the result
+/// renders exactly like the sequential concatenation.
+template <class RandomIt, class Fn>
+auto parallel_concat(RandomIt first, RandomIt last, Fn fn,
+                     unsigned threads = 0)
+    -> std::invoke_result_t<Fn&, decltype(*first)>;
+
+/// Like the above, but worker `i` builds its documents with
+/// `resources[i]` as its memory resource, so each worker can allocate
+/// from its own (unsynchronized) arena. The resources must outlive the
+/// result.
+template <class RandomIt, class Fn>
+auto parallel_concat(RandomIt first, RandomIt last, Fn fn,
+                     const std::vector<std::pmr::memory_resource*>& resources)
+    -> std::invoke_result_t<Fn&, decltype(*first)>;
+
+/// Renders each document in the random-access range `[first, last)` at the
+/// given width on up to `threads` worker threads, passing each result to
+/// `sink(std::string_view)` on the calling thread in input order, as soon
+/// as each document and all before it are rendered. The workers are
+/// started once for the batch; idle workers take the next unrendered
+/// document, and each keeps a pooled memory resource for render scratch
+/// space from one document to the next. The calling thread renders too
+/// when it has nothing to hand on. Renderers are made by
+/// `make_renderer(std::ostream&)`.
+template <class RandomIt, class Sink, class MakeRenderer>
+void render_batch(RandomIt first, RandomIt last, int width, Sink sink,
+                  unsigned threads, MakeRenderer make_renderer);
+
+/// Renders a batch of documents in parallel, ignoring annotations.
+template <class RandomIt, class Sink>
+void render_batch(RandomIt first, RandomIt last, int width, Sink sink,
+                  unsigned threads = 0);
+
+/////
+///// Implementations
+/////
+
+namespace detail {
+
+template <class RandomIt, class Fn>
+auto parallel_concat(RandomIt first, RandomIt last, Fn& fn,
+                     unsigned workers,
+                     std::pmr::memory_resource* const* resources)
+    -> std::invoke_result_t<Fn&, decltype(*first)>
+{
+    using document_type = std::invoke_result_t<Fn&, decltype(*first)>;
+
+    const size_t count = size_t(std::distance(first, last));
+    const size_t chunks = std::min(count, size_t(workers) * 4);
+
+    // Empty slots, so that no node is made on this thread and freed on a
+    // worker: the caller's resource need not be synchronized.
+    std::vector<std::optional<document_type>> parts(chunks);
+
+    parallel_for(chunks, workers, [&](unsigned worker, size_t chunk) {
+        std::pmr::memory_resource* resource =
+                resources ? resources[worker] : get_memory_resource();
+        memory_resource_scope scope(resource);
+
+        auto begin = first + (count * chunk / chunks);
+        auto end   = first + (count * (chunk + 1) / chunks);
+
+        document_type part = fn(*begin);
+        while (++begin != end)
+            part = std::move(part).append(fn(*begin));
+        parts[chunk].emplace(std::move(part));
+    });
+
+    if (parts.empty()) return document_type();
+
+    document_type result = std::move(*parts.front());
+    for (size_t i = 1; i < parts.size(); ++i)
+        result = std::move(result).append(std::move(*parts[i]));
+    return result;
+}
+
+}
+
+template <class RandomIt, class Fn>
+auto parallel_concat(RandomIt first, RandomIt last, Fn fn, unsigned threads)
+    -> std::invoke_result_t<Fn&, decltype(*first)>
+{
+    unsigned workers = detail::worker_count(threads, size_t(last - first));
+    return detail::parallel_concat(first, last, fn, workers, nullptr);
+}
+
+template <class RandomIt, class Fn>
+auto parallel_concat(RandomIt first, RandomIt last, Fn fn,
+                     const std::vector<std::pmr::memory_resource*>& resources)
+    -> std::invoke_result_t<Fn&, decltype(*first)>
+{
+    if (resources.empty())
+        return parallel_concat(first, last, std::move(fn));
+
+    unsigned workers = detail::worker_count(unsigned(resources.size()),
+                                            size_t(last - first));
+    return detail::parallel_concat(first, last, fn, workers, resources.data());
+}
+
+template <class RandomIt, class Sink, class MakeRenderer>
+void render_batch(RandomIt first, RandomIt last, const int width, Sink sink,
+                  unsigned threads, MakeRenderer make_renderer)
+{
+    const size_t count = size_t(std::distance(first, last));
+    const unsigned workers = detail::worker_count(threads, count);
+
+    // The workers live for the whole batch and results are handed to the
+    // sink as they complete, in order, while later documents render. Only
+    // a window of results is buffered, in strings reused from one document
+    // to the next.
+    std::vector<detail::job_output> buffers(size_t(workers) * 16);
+    std::vector<std::pmr::unsynchronized_pool_resource> scratch(workers);
+
+    auto work = [&](unsigned worker, size_t job) {
+        memory_resource_scope scope(&scratch[worker]);
+
+        detail::job_output& buffer = buffers[job % buffers.size()];
+        buffer.text.clear();
+
+        auto renderer = make_renderer(buffer.stream);
+        first[job].render(renderer, width);
+    };
+
+    auto emit = [&](size_t job) {
+        sink(std::string_view(buffers[job % buffers.size()].text));
+    };
+
+    detail::ordered_for(count, workers, buffers.size(), work, emit);
+}
+
+template <class RandomIt, class Sink>
+void render_batch(RandomIt first, RandomIt last, const int width, Sink sink,
+                  unsigned threads)
+{
+    render_batch(first, last, width, std::move(sink), threads,
+                 [](std::ostream& buffer) {
+                     return no_annotation_renderer<>(buffer);
+                 });
+}
+
+}
@@ -1,10 +1,24 @@
 #pragma once
 
 #include "renderers.h"
-
+#include "source_map.h"
+#include "workers.h"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
 #include <functional>
 #include <memory>
+#include <memory_resource>
+#include <new>
+#include <optional>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <type_traits>
 #include <variant>
 #include <vector>
@@ -15,26 +29,140 @@ namespace pretty {
 /// Class to indicate no annotations.
 class no_annotation {};
 
+/// Text whose width is known at compile time, usually from a `_doc`
+/// literal, which converts to a document without measuring it. The text
+/// is borrowed, so it should be a string literal.
+struct text_literal
+{
+    std::string_view text;
+    size_t size;
+};
+
+namespace literals {
+
+/// `"foo"_doc` is a `text_literal` of width 3.
+constexpr text_literal operator""_doc(const char* s, size_t n)
+{
+    return text_literal { std::string_view(s, n), n };
+}
+
+}
+
+/// Returns the memory resource that documents and render scratch space
+/// are allocated from on the current thread. Unless set, this is
+/// `std::pmr::get_default_resource()`.
+std::pmr::memory_resource* get_memory_resource() noexcept;
+
+/// Sets the memory resource for the current thread, returning the previous
+/// one. Passing `nullptr` reverts to `std::pmr::get_default_resource()`.
+std::pmr::memory_resource* set_memory_resource(std::pmr::memory_resource*) noexcept;
+
+/// Sets the current thread's memory resource for the lifetime of the
+/// object, restoring the previous one on destruction. Documents built in
+/// the scope must not outlive the resource.
+class memory_resource_scope
+{
+public:
+    explicit memory_resource_scope(std::pmr::memory_resource* resource)
+            : saved_(set_memory_resource(resource))
+    { }
+
+    ~memory_resource_scope() { set_memory_resource(saved_); }
+
+    memory_resource_scope(const memory_resource_scope&) = delete;
+    memory_resource_scope& operator=(const memory_resource_scope&) = delete;
+
+private:
+    std::pmr::memory_resource* saved_;
+};
+
+/// Options for a render that may stop early or elide parts of the document.
+/// When output stops, the ellipsis is written and any open annotations are
+/// closed.
+struct render_options
+{
+    /// Stop before starting line `max_lines + 1`.
+    size_t max_lines = SIZE_MAX;
+    /// Stop once this many bytes have been written.
+    size_t max_bytes = SIZE_MAX;
+    /// Stop after visiting this many document nodes.
+    size_t max_nodes = SIZE_MAX;
+    /// Show at most this many levels of elidable documents, replacing
+    /// those deeper by their placeholders; 0 replaces even the outermost.
+    size_t max_depth = SIZE_MAX;
+    /// Replace elidable documents wider than this when laid out flat by
+    /// their placeholders.
+    size_t max_flat_width = SIZE_MAX;
+    /// Stop once this is set, from any thread.
+    const std::atomic<bool>* cancel = nullptr;
+    /// Stop once this time has passed.
+    std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::time_point::max();
+    /// How many nodes to visit, in layout or lookahead, between checks of
+    /// `cancel` and `deadline`.
+    size_t check_interval = 1024;
+    /// Written where output stops early.
+    std::string_view ellipsis = "...";
+};
+
+/// How `escaped` documents escape string literals.
+enum class escape_style
+{
+    /// C and C++: `\n`-style escapes, and octal for other control
+    /// characters and DEL.
+    c,
+    /// JSON: `\n`-style escapes, and `\u00XX` for other control
+    /// characters.
+    json,
+};
+
+/// How a render ended.
+enum class render_status
+{
+    /// The whole document was rendered.
+    complete,
+    /// Output stopped early because a limit was reached.
+    truncated,
+    /// Output stopped early because of cancellation or the deadline.
+    cancelled,
+};
+
 /// A document, parameterized by annotation type.
 template<class Annot>
 class annotated_document
 {
 public:
-    /// Owned text is represented using `std::string`.
-    using text_type = std::string;
+    /// Owned text is represented using `std::pmr::string`, allocated from
+    /// the current memory resource.
+    using text_type = std::pmr::string;
 
     /// Borrowed text is represented using `std::string_view`.
     using text_view_type = std::string_view;
 
     /// The annotation type.
     using annot_type =
-        std::conditional<std::is_same_v<void, Annot>,
+        std::conditional_t<std::is_same_v<void, Annot>,
             no_annotation,
             Annot>;
 
+    /// The number of bytes a node takes, for sizing arenas.
+    static constexpr size_t node_size();
+
 private:
-    struct owned_text_ { text_type s; size_t size; };
+    struct owned_text_
+    {
+        text_type s;
+        size_t size;
+
+        owned_text_(text_type s, size_t size) : s(std::move(s)), size(size) {}
+        owned_text_(const owned_text_&);
+        owned_text_(owned_text_&&) noexcept = default;
+        owned_text_& operator=(const owned_text_&) = default;
+        owned_text_& operator=(owned_text_&&) noexcept = default;
+    };
     struct borrowed_text_ { text_view_type sv; size_t size; };
+    struct escaped_ { text_view_type sv; escape_style style; size_t size; };
+    struct number_ { char digits[31]; unsigned char size; };
     struct nil_ {};
     struct line_ { bool no_space; };
     struct append_ { annotated_document first, second; };
@@ -42,24 +170,58 @@ private:
     struct nest_ { int amount; annotated_document document; };
     struct annot_ { annot_type annot; annotated_document document; };
     struct align_ { annotated_document document; };
+    struct lazy_ { std::function<annotated_document()> generate; };
+    struct elide_ { annotated_document document, placeholder; };
+    struct span_ { size_t begin, end; annotated_document document; };
+    struct source_ { size_t id; annotated_document document; };
 
     using repr_ = std::variant<
             owned_text_,
             borrowed_text_,
+            escaped_,
+            number_,
             nil_,
             line_,
             append_,
             group_,
             nest_,
             annot_,
-            align_
+            align_,
+            lazy_,
+            elide_,
+            span_,
+            source_
     >;
 
-    std::unique_ptr<repr_> pimpl_;
+    // Nodes remember the resource they came from so that they can be
+    // returned to it; shared nodes have none.
+    struct node_deleter_
+    {
+        std::pmr::memory_resource* resource = nullptr;
+        void operator()(repr_*) const;
+    };
+
+    std::unique_ptr<repr_, node_deleter_> pimpl_;
+
+    // Refers to a node owned by another document, which is never freed
+    // through this one.
+    struct shared_tag_ {};
+    annotated_document(shared_tag_, repr_* node)
+            : pimpl_(node, node_deleter_{nullptr}) {}
 
+    // Whether `Arg...` is a single document, which should be copied or
+    // moved rather than emplaced.
     template <class... Arg>
+    static constexpr bool is_document_ =
+        sizeof...(Arg) == 1 &&
+        (std::is_same_v<std::decay_t<Arg>, annotated_document> && ...);
+
+    template <class... Arg,
+              class = std::enable_if_t<!is_document_<Arg...>>>
     explicit annotated_document(Arg&& ...);
 
+    static std::pmr::polymorphic_allocator<char> allocator_();
+
     enum class mode_ { breaking, flat };
 
     struct cmd_
@@ -69,17 +231,142 @@ private:
         const annotated_document* doc;
     };
 
-    using cmd_stack_ = std::vector<cmd_>;
+    using cmd_stack_ = std::pmr::vector<cmd_>;
+
+    using forced_ptr_ = std::shared_ptr<const annotated_document>;
+
+    // A lazy document forced by lookahead, waiting for render to reach it.
+    struct forced_ { const lazy_* node; forced_ptr_ doc; };
+
+    // A forced lazy document being rendered, which is released once the
+    // stack shrinks back to `level`.
+    struct piece_ { size_t level; forced_ptr_ doc; };
+
+    static forced_ptr_ generate_(const lazy_&);
+
+    struct open_annot_ { size_t level; const annot_type* annot; };
+
+    struct open_span_ { size_t level; const span_* span; };
+
+    struct open_source_ { size_t level; size_t id; };
+
+    // The widths `[lo, hi)` at which a layout is the same, as far as can
+    // be told by looking ahead no further than `limit` columns.
+    struct widths_ { int lo; int hi; int limit; };
+
+    // The state of a render in progress, advanced one command at a time.
+    struct render_state_
+    {
+        render_state_(const annotated_document&, int width);
+        render_state_(int width, int pos, cmd_stack_ stack);
+
+        bool done() const { return stack.empty(); }
+
+        // Counts a visited node, checking for cancellation every
+        // `check_interval` nodes. Returns whether rendering should stop.
+        bool tick()
+        {
+            return --countdown == 0 && poll();
+        }
+
+        bool poll();
+
+        template <class Renderer>
+        void step(Renderer&);
+
+        // Closes any open annotations when stopping early.
+        template <class Renderer>
+        void close(Renderer&);
+
+        // Whether `next` fits in the rest of the line when followed by the
+        // commands on the stack.
+        bool fits(cmd_ next);
+
+        // Whether `next`, followed by the commands in `[todo_begin,
+        // todo_end)`, fits in `space_remaining`, using `scratch` as the work
+        // stack. On success, `space_remaining` is left with what's left
+        // over. If `elide` is false, elidable documents are measured whole.
+        bool fits_(cmd_ next,
+                   typename cmd_stack_::const_reverse_iterator todo_begin,
+                   typename cmd_stack_::const_reverse_iterator todo_end,
+                   int& space_remaining,
+                   cmd_stack_& scratch,
+                   bool elide);
+
+        // Whether an elidable document reached now, nested inside `depth`
+        // elidable documents, is replaced by its placeholder.
+        bool elides(const elide_&, size_t depth);
+
+        // Forces a lazy document, reusing the result of lookahead.
+        forced_ptr_ force(const lazy_&);
+
+        int width;
+        int pos;
+        cmd_stack_ stack;
+        cmd_stack_ aux_stack;
+        // The open annotations and the stack sizes at which they end.
+        std::pmr::vector<open_annot_> annot_stack;
+        std::pmr::vector<forced_> lookahead;
+        std::pmr::vector<piece_> pieces;
+
+        // Elision budgets, and the stack sizes at which the elidable
+        // documents being rendered, or being looked ahead at by `fits`, end.
+        size_t max_depth = SIZE_MAX;
+        size_t max_flat_width = SIZE_MAX;
+        std::pmr::vector<size_t> elide_levels;
+        std::pmr::vector<size_t> fits_elide_levels;
+        cmd_stack_ measure_stack;
+
+        // Cancellation, checked only if set.
+        const std::atomic<bool>* cancel = nullptr;
+        std::chrono::steady_clock::time_point deadline =
+                std::chrono::steady_clock::time_point::max();
+        size_t check_interval = SIZE_MAX;
+        size_t countdown = SIZE_MAX;
+        bool cancelled = false;
+
+        // If set, narrowed by each group decision to the widths at which
+        // that decision comes out the same.
+        widths_* widths = nullptr;
+
+        // The source spans being rendered and the stack sizes at which they
+        // end.
+        std::pmr::vector<open_span_> span_stack;
+
+        // Likewise for source ids, which are tracked only if set.
+        bool map_sources = false;
+        std::pmr::vector<open_source_> source_stack;
+    };
+
+    // A stretch of the document that starts after a top-level forced line
+    // break (or at the beginning), and so at column `indent` regardless of
+    // what precedes it.
+    struct segment_
+    {
+        int indent;
+        std::vector<cmd_> cmds;
+    };
+
+    std::vector<segment_> split_forced_() const;
+
+    // A number document from `format(first, last)`, which acts like
+    // `std::to_chars`.
+    template <class Format>
+    static annotated_document format_number_(Format format);
 
-    static bool fits(cmd_ next,
-                     const cmd_stack_& todo,
-                     cmd_stack_& stack,
-                     int space_remaining);
+    // The union of the outermost source spans in a document, or nothing if
+    // it has lazy parts whose spans can't be known without forcing them.
+    static std::optional<std::pair<size_t, size_t>>
+    span_bounds_(const annotated_document&);
 
 public:
     /// Constructs the empty (nil) document.
     annotated_document() : annotated_document(nil_ {}) {}
-    /// Deep-copy constructs a document.
+    /// Constructs a text view document of a known width.
+    annotated_document(text_literal lit)
+            : annotated_document(borrowed_text_ { lit.text, lit.size }) {}
+    /// Deep-copy constructs a document, unless it was made by `share`, in
+    /// which case the copy shares too.
     annotated_document(const annotated_document&);
     /// Deep-copy assigns a document.
     annotated_document& operator=(const annotated_document&);
@@ -107,10 +394,38 @@ public:
     /// differ from the length C++ considers the string_view to have.
     static annotated_document view_size(size_t, text_view_type);
 
+    /// Constructs a document for an integer in the given base. The digits
+    /// are stored in the node, without allocating.
+    template <class Int,
+              class = std::enable_if_t<std::is_integral_v<Int>>>
+    static annotated_document number(Int, int base = 10);
+
+    /// Constructs a document for a floating-point number in the shortest
+    /// form that reads back exactly, or in the given format and precision
+    /// (as with `std::to_chars`). Short results are stored in the node,
+    /// without allocating.
+    static annotated_document number(double);
+    static annotated_document number(double, std::chars_format);
+    static annotated_document number(double, std::chars_format, int precision);
+
+    /// Constructs a document for a quoted string literal containing the
+    /// viewed bytes, which are escaped as they are rendered. Bytes from 0x80
+    /// up are written as they are, so UTF-8 passes through.
+    static annotated_document escaped(text_view_type sv,
+                                      escape_style = escape_style::c);
+
     /// Constructs a line-break document. By default, inserts a space when
     /// broken, but `no_space` set to true overrides this behavior.
     static annotated_document line(bool no_space = false);
 
+    /// Constructs a lazy document, which calls `generate` for its contents
+    /// only when rendering reaches it, or when deciding whether an enclosing
+    /// group fits needs to look into it. Its contents are released once
+    /// rendered, so a chain of lazy documents (each generating some output
+    /// followed by the next) streams in bounded memory. `generate` is called
+    /// once per render; copying the document copies the callable.
+    static annotated_document lazy(std::function<annotated_document()> generate);
+
     /// Appends two documents.
     annotated_document append(annotated_document) &&;
 
@@ -127,9 +442,260 @@ public:
     template <class... Arg>
     annotated_document annotate(Arg&&...) &&;
 
+    /// Marks the document as elidable: a render with depth or width
+    /// budgets (see `render_options`) lays out `placeholder` in its place
+    /// when it is nested too deeply or is too wide, and then never renders
+    /// the document itself. Deciding by depth forces nothing; deciding by
+    /// width forces lazy parts only as far as the budget reaches, and the
+    /// results are discarded if the document is elided.
+    annotated_document elidable(annotated_document placeholder) &&;
+
+    /// Returns a document that refers to this one instead of copying it, so
+    /// it costs no allocation. This document must outlive the result and
+    /// everything built from it, as a `static` constant made by `constant`
+    /// does:
+    ///
+    ///     static const document comma = document::constant(","_doc);
+    ///     ... .append(comma.share()) ...
+    annotated_document share() const;
+
+    /// Copies a document for use as a long-lived constant, allocating its
+    /// nodes from `std::pmr::new_delete_resource()`. A `static` document
+    /// initialized directly would take its nodes from whatever resource is
+    /// current the first time its initializer runs, which may be an arena
+    /// released long before the constant is last used.
+    static annotated_document constant(const annotated_document&);
+
+    /// Records that the document was formatted from the source range
+    /// `[begin, end)`, for `render_range`.
+    annotated_document with_span(size_t begin, size_t end) &&;
+
+    /// Records that the document was generated from the source (such as a
+    /// syntax tree node) with the given id, for source maps.
+    annotated_document with_source(size_t id) &&;
+
     /// Render to a generic renderer.
     template <class Renderer>
     void render(Renderer&, int width) const;
+
+    /// Renders to a generic renderer, stopping as soon as a limit in
+    /// `options` is reached or the render is cancelled. Layout stops too,
+    /// so the cost depends on how much is rendered rather than on the size
+    /// of the document.
+    template <class Renderer>
+    render_status render(Renderer&, int width, const render_options&) const;
+
+    /// Renders to a generic renderer, recording in `map` which source (see
+    /// `with_source`) each part of the output was generated from.
+    template <class Renderer>
+    void render(Renderer&, int width, source_map& map) const;
+
+    class chunked_render;
+
+    class line_index;
+
+    /// Renders only the lines that contain text from source spans (see
+    /// `with_span`) overlapping `[begin, end)`, plus any lines between them,
+    /// like `line_index::render`. Stretches of the document between
+    /// top-level line breaks that always break are laid out only if they
+    /// may contain such text. Returns the union of the innermost spans
+    /// whose text was rendered, which is the source range the output
+    /// replaces, or an empty range if nothing was rendered.
+    template <class Renderer>
+    std::pair<size_t, size_t>
+    render_range(Renderer&, int width, size_t begin, size_t end) const;
+
+    class layout_result;
+
+    /// Lays out the whole document once at the given width, recording the
+    /// output as a list of instructions that can be replayed to any number
+    /// of renderers without making layout decisions again.
+    layout_result layout(int width) const;
+
+    class responsive_layout;
+
+    /// Prepares to lay out the document at varying widths, such as a
+    /// terminal's as it is resized. Each layout is cached along with the
+    /// interval of widths that give the same layout. Looking ahead for
+    /// that interval stops at `max_width` columns. The document must
+    /// outlive the result.
+    responsive_layout responsive(int max_width) const;
+
+    /// Lays out the whole document once at the given width, recording a
+    /// checkpoint every `interval` lines, so that any range of lines can
+    /// later be rendered by resuming from the nearest checkpoint. The
+    /// document must outlive the result.
+    line_index index_lines(int width, size_t interval = 1024) const;
+
+    /// Starts a render whose output is pulled in chunks of at most
+    /// `chunk_size` bytes. Annotations are ignored. The document must
+    /// outlive the result.
+    chunked_render render_chunks(int width, size_t chunk_size) const;
+
+    /// Renders to a stream like `render`, but lays out the stretches between
+    /// top-level line breaks (which always break) on up to `threads` worker
+    /// threads, or one per hardware thread if 0. Each worker renders into
+    /// its own buffer through a renderer made by
+    /// `make_renderer(std::ostream&)`, and each buffer is written to `out`
+    /// as soon as everything before it has been, so only a few runs of
+    /// stretches are held in memory at once. Annotated parts are not split
+    /// across stretches.
+    template <class MakeRenderer>
+    void render_parallel(std::ostream& out, int width, unsigned threads,
+                         MakeRenderer make_renderer) const;
+
+    /// Renders in parallel to a stream, ignoring annotations.
+    void render_parallel(std::ostream& out, int width,
+                         unsigned threads = 0) const;
+
+private:
+    layout_result layout_(int width, widths_*) const;
+};
+
+/// A render in progress whose output is pulled in bounded chunks rather
+/// than pushed to a renderer, so the consumer sets the pace. Layout only
+/// advances as far as needed to fill the next chunk, so apart from the
+/// layout state, memory use is bounded by the chunk size and the largest
+/// single text in the document.
+template <class Annot>
+class annotated_document<Annot>::chunked_render
+{
+public:
+    /// Returns the next chunk of output, or nothing once the render is
+    /// complete. The view is valid until the next call.
+    std::optional<std::string_view> next();
+
+private:
+    friend class annotated_document;
+
+    chunked_render(const annotated_document&, int width, size_t chunk_size);
+
+    render_state_ state_;
+    size_t chunk_size_;
+    std::unique_ptr<string_output> buffer_;
+    no_annotation_renderer<string_output> renderer_;
+    size_t offset_ = 0;
+};
+
+/// Checkpoints of a document's layout at a fixed width, for rendering
+/// ranges of lines (such as a viewport) without laying out everything
+/// before them. Checkpoints keep forced lazy documents alive; lazy
+/// documents first reached after a checkpoint are generated again each
+/// time rendering resumes from it.
+template <class Annot>
+class annotated_document<Annot>::line_index
+{
+public:
+    /// The number of lines in the rendered document.
+    size_t lines() const { return lines_; }
+
+    /// The width the document was laid out at.
+    int width() const { return width_; }
+
+    /// Renders lines `[first, first + count)`, counting from 0, by resuming
+    /// layout from the nearest checkpoint. Annotations open at the start
+    /// of the range are entered first, and any still open at the end are
+    /// left. The first line's indentation is written as spaces.
+    template <class Renderer>
+    void render(Renderer&, size_t first, size_t count) const;
+
+private:
+    friend class annotated_document;
+
+    explicit line_index(int width) : width_(width) {}
+
+    struct checkpoint_ { size_t line; render_state_ state; };
+
+    std::vector<checkpoint_> checkpoints_;
+    size_t lines_ = 1;
+    int width_;
+};
+
+/// A document laid out at a fixed width: a list of text runs, line breaks
+/// and annotation changes. Replaying it takes time linear in its length.
+/// The result holds its own copies of the text and annotations, so it
+/// does not refer to the document.
+template <class Annot>
+class annotated_document<Annot>::layout_result
+{
+public:
+    /// The width the document was laid out at.
+    int width() const { return width_; }
+
+    /// The number of lines in the layout.
+    size_t lines() const { return lines_; }
+
+    /// Sends the recorded output to a generic renderer.
+    template <class Renderer>
+    void replay(Renderer&) const;
+
+    /// Sends lines `[first, first + count)` to a generic renderer, like
+    /// `line_index::render`.
+    template <class Renderer>
+    void replay(Renderer&, size_t first, size_t count) const;
+
+private:
+    friend class annotated_document;
+
+    explicit layout_result(int width) : width_(width) {}
+
+    enum class op_kind_ : unsigned char { text, newline, push, pop };
+
+    // For text, the length of the run; for a newline, the indentation.
+    struct op_ { op_kind_ kind; size_t arg; };
+
+    // A renderer that appends to a layout, merging adjacent text.
+    struct recorder_
+    {
+        layout_result& result;
+
+        void write(std::string_view sv) { append(sv.data(), sv.size()); }
+        void write(char c) { append(&c, 1); }
+        void append(const char*, size_t);
+        void newline(int indent);
+        void push_annotation(const annot_type&);
+        void pop_annotation();
+    };
+
+    std::vector<op_> ops_;
+    std::string text_;
+    std::vector<annot_type> annots_;
+    size_t lines_ = 1;
+    int width_;
+};
+
+/// Layouts of a document at varying widths. Laying out at one width finds
+/// the interval of widths around it at which every group is broken or
+/// flat alike, and so the layout is the same; the layout is cached for
+/// the whole interval.
+template <class Annot>
+class annotated_document<Annot>::responsive_layout
+{
+public:
+    /// The layout at the given width, computed if not cached.
+    const layout_result& at(int width);
+
+    /// The widths `[first, second)` that give the same layout as `width`.
+    std::pair<int, int> interval(int width);
+
+    /// The widths in `(first, last]` at which the layout changes, laying
+    /// out everything in between.
+    std::vector<int> breakpoints(int first, int last);
+
+private:
+    friend class annotated_document;
+
+    responsive_layout(const annotated_document& doc, int max_width)
+            : doc_(doc), max_width_(max_width)
+    { }
+
+    struct entry_ { int lo; int hi; layout_result layout; };
+
+    const entry_& entry_at_(int width);
+
+    const annotated_document& doc_;
+    int max_width_;
+    std::vector<entry_> cache_;
 };
 
 /// An unannotated document.
@@ -139,18 +705,184 @@ using document = annotated_document<void>;
 ///// Implementations
 /////
 
+namespace detail {
+
+inline std::pmr::memory_resource*& thread_memory_resource()
+{
+    thread_local std::pmr::memory_resource* resource = nullptr;
+    return resource;
+}
+
+// The escape sequence for a byte that `find_escape` stops at, written
+// into `buf`.
+inline std::string_view escape(char c, escape_style style, char (&buf)[6])
+{
+    switch (c) {
+        case '"':  return "\\\"";
+        case '\\': return "\\\\";
+        case '\n': return "\\n";
+        case '\t': return "\\t";
+        case '\r': return "\\r";
+        case '\b': return "\\b";
+        case '\f': return "\\f";
+    }
+
+    static const char hex[] = "0123456789abcdef";
+    auto byte = static_cast<unsigned char>(c);
+
+    if (style == escape_style::json) {
+        std::memcpy(buf, "\\u00", 4);
+        buf[4] = hex[byte >> 4];
+        buf[5] = hex[byte & 15];
+        return std::string_view(buf, 6);
+    } else {
+        buf[0] = '\\';
+        buf[1] = char('0' + (byte >> 6));
+        buf[2] = char('0' + ((byte >> 3) & 7));
+        buf[3] = char('0' + (byte & 7));
+        return std::string_view(buf, 4);
+    }
+}
+
+// The width of a string literal, quotes included.
+inline size_t escaped_size(std::string_view sv, escape_style style)
+{
+    const char* p = sv.data();
+    const char* end = p + sv.size();
+    size_t size = 2;
+    char buf[6];
+
+    for (;;) {
+        const char* special = find_escape(p, end, style == escape_style::c);
+        size += size_t(special - p);
+        if (special == end) return size;
+
+        size += escape(*special, style, buf).size();
+        p = special + 1;
+    }
+}
+
+// Writes a string literal, quotes included, a run at a time.
+template <class Renderer>
+void write_escaped(Renderer& out, std::string_view sv, escape_style style)
+{
+    const char* p = sv.data();
+    const char* end = p + sv.size();
+    char buf[6];
+
+    out.write('"');
+
+    for (;;) {
+        const char* special = find_escape(p, end, style == escape_style::c);
+        if (special != p) out.write(std::string_view(p, size_t(special - p)));
+        if (special == end) break;
+
+        out.write(escape(*special, style, buf));
+        p = special + 1;
+    }
+
+    out.write('"');
+}
+
+}
+
+inline std::pmr::memory_resource* get_memory_resource() noexcept
+{
+    std::pmr::memory_resource* resource = detail::thread_memory_resource();
+    return resource ? resource : std::pmr::get_default_resource();
+}
+
+inline std::pmr::memory_resource*
+set_memory_resource(std::pmr::memory_resource* resource) noexcept
+{
+    std::pmr::memory_resource* previous = get_memory_resource();
+    detail::thread_memory_resource() = resource;
+    return previous;
+}
+
+template<class Annot>
+auto annotated_document<Annot>::allocator_()
+        -> std::pmr::polymorphic_allocator<char>
+{
+    return std::pmr::polymorphic_allocator<char>(get_memory_resource());
+}
+
+template<class Annot>
+constexpr size_t annotated_document<Annot>::node_size()
+{
+    return sizeof(repr_);
+}
+
+template<class Annot>
+annotated_document<Annot>::owned_text_::owned_text_(const owned_text_& other)
+        : s(other.s, allocator_()), size(other.size)
+{ }
+
+template<class Annot>
+void annotated_document<Annot>::node_deleter_::operator()(repr_* node) const
+{
+    if (!resource) return;
+
+    auto free = [](repr_* node, std::pmr::memory_resource* resource) {
+        node->~repr_();
+        resource->deallocate(node, sizeof(repr_), alignof(repr_));
+    };
+
+    // Freeing a node frees its children, which would recurse as deep as the
+    // document goes. Instead, nodes reached while another is being freed
+    // are queued, and the outermost call frees them in a loop.
+    using queue_ = std::vector<std::pair<repr_*, std::pmr::memory_resource*>>;
+    static thread_local queue_* pending = nullptr;
+
+    if (pending) {
+        try {
+            pending->emplace_back(node, resource);
+        } catch (const std::bad_alloc&) {
+            free(node, resource);
+        }
+        return;
+    }
+
+    queue_ queue;
+    pending = &queue;
+    free(node, resource);
+
+    while (!queue.empty()) {
+        auto [next, next_resource] = queue.back();
+        queue.pop_back();
+        free(next, next_resource);
+    }
+
+    pending = nullptr;
+}
+
 template<class Annot>
 annotated_document<Annot>::annotated_document(
         const annotated_document& other)
-        : annotated_document(*other.pimpl_)
+        : annotated_document(other.pimpl_.get_deleter().resource
+                             ? annotated_document(*other.pimpl_)
+                             : other.share())
 { }
 
+template<class Annot>
+auto annotated_document<Annot>::share() const -> annotated_document
+{
+    return annotated_document(shared_tag_{}, pimpl_.get());
+}
+
+template<class Annot>
+auto annotated_document<Annot>::constant(const annotated_document& doc)
+        -> annotated_document
+{
+    memory_resource_scope scope(std::pmr::new_delete_resource());
+    return annotated_document(doc);
+}
+
 template<class Annot>
 auto annotated_document<Annot>::operator=(
         const annotated_document& other) -> annotated_document&
 {
-    *pimpl_ = *other.pimpl_;
-    return *this;
+    return *this = annotated_document(other);
 }
 
 template<class Annot>
@@ -163,7 +895,7 @@ template<class Annot>
 template<class... Arg>
 auto annotated_document<Annot>::text(Arg&& ... arg) -> annotated_document
 {
-    text_type str(std::forward<Arg>(arg)...);
+    text_type str(std::forward<Arg>(arg)..., allocator_());
     return text_size(str.size(), std::move(str));
 }
 
@@ -172,8 +904,9 @@ template<class... Arg>
 auto annotated_document<Annot>::text_size(size_t size,
                                           Arg&&... arg) -> annotated_document
 {
-    return annotated_document(owned_text_{ text_type(std::forward<Arg>(arg)...),
-                                           size });
+    return annotated_document(
+            owned_text_{ text_type(std::forward<Arg>(arg)..., allocator_()),
+                         size });
 }
 
 template<class Annot>
@@ -183,6 +916,76 @@ auto annotated_document<Annot>::view(
     return view_size(sv.size(), sv);
 }
 
+template<class Annot>
+template<class Format>
+auto annotated_document<Annot>::format_number_(Format format)
+        -> annotated_document
+{
+    number_ number;
+    auto result = format(number.digits, number.digits + sizeof number.digits);
+
+    if (result.ec == std::errc()) {
+        number.size = static_cast<unsigned char>(result.ptr - number.digits);
+        return annotated_document(number);
+    }
+
+    // Too long to store inline, as a double in fixed notation may be.
+    text_type digits(allocator_());
+    do {
+        digits.resize(std::max(size_t(64), digits.size() * 2));
+        result = format(digits.data(), digits.data() + digits.size());
+    } while (result.ec != std::errc());
+
+    digits.resize(size_t(result.ptr - digits.data()));
+    size_t size = digits.size();
+    return annotated_document(owned_text_ { std::move(digits), size });
+}
+
+template<class Annot>
+template<class Int, class>
+auto annotated_document<Annot>::number(Int value, int base) -> annotated_document
+{
+    return format_number_([=](char* first, char* last) {
+        return std::to_chars(first, last, value, base);
+    });
+}
+
+template<class Annot>
+auto annotated_document<Annot>::number(double value) -> annotated_document
+{
+    return format_number_([=](char* first, char* last) {
+        return std::to_chars(first, last, value);
+    });
+}
+
+template<class Annot>
+auto annotated_document<Annot>::number(
+        double value, std::chars_format format) -> annotated_document
+{
+    return format_number_([=](char* first, char* last) {
+        return std::to_chars(first, last, value, format);
+    });
+}
+
+template<class Annot>
+auto annotated_document<Annot>::number(
+        double value, std::chars_format format, int precision)
+        -> annotated_document
+{
+    return format_number_([=](char* first, char* last) {
+        return std::to_chars(first, last, value, format, precision);
+    });
+}
+
+template<class Annot>
+auto annotated_document<Annot>::escaped(
+        annotated_document::text_view_type sv,
+        escape_style style) -> annotated_document
+{
+    return annotated_document(escaped_ { sv, style,
+                                         detail::escaped_size(sv, style) });
+}
+
 template<class Annot>
 auto annotated_document<Annot>::view_size(
         size_t size,
@@ -192,10 +995,20 @@ auto annotated_document<Annot>::view_size(
 }
 
 template<class Annot>
-template<class... Arg>
+template<class... Arg, class>
 annotated_document<Annot>::annotated_document(Arg&& ... arg)
-        : pimpl_{std::make_unique<repr_>(std::forward<Arg>(arg)...)}
-{ }
+{
+    std::pmr::memory_resource* resource = get_memory_resource();
+    void* mem = resource->allocate(sizeof(repr_), alignof(repr_));
+
+    try {
+        pimpl_ = {::new(mem) repr_(std::forward<Arg>(arg)...),
+                  node_deleter_{resource}};
+    } catch (...) {
+        resource->deallocate(mem, sizeof(repr_), alignof(repr_));
+        throw;
+    }
+}
 
 template<class Annot>
 auto annotated_document<Annot>::line(bool no_space) -> annotated_document
@@ -203,6 +1016,33 @@ auto annotated_document<Annot>::line(bool no_space) -> annotated_document
     return annotated_document(line_ { no_space });
 }
 
+template<class Annot>
+auto annotated_document<Annot>::with_source(size_t id) && -> annotated_document
+{
+    return annotated_document(source_ { id, std::move(*this) });
+}
+
+template<class Annot>
+auto annotated_document<Annot>::with_span(
+        size_t begin, size_t end) && -> annotated_document
+{
+    return annotated_document(span_ { begin, end, std::move(*this) });
+}
+
+template<class Annot>
+auto annotated_document<Annot>::elidable(
+        annotated_document placeholder) && -> annotated_document
+{
+    return annotated_document(elide_ { std::move(*this), std::move(placeholder) });
+}
+
+template<class Annot>
+auto annotated_document<Annot>::lazy(
+        std::function<annotated_document()> generate) -> annotated_document
+{
+    return annotated_document(lazy_ { std::move(generate) });
+}
+
 template<class Annot>
 auto annotated_document<Annot>::append(
         annotated_document next)&& -> annotated_document
@@ -238,30 +1078,74 @@ auto annotated_document<Annot>::annotate(Arg&&... arg) && -> annotated_document
 
 template<class Annot>
 bool
-annotated_document<Annot>::fits(
+annotated_document<Annot>::render_state_::fits(cmd_ next)
+{
+    if (!widths) {
+        int space_remaining = width - pos;
+        return fits_(next, stack.crbegin(), stack.crend(), space_remaining,
+                     aux_stack, true);
+    }
+
+    // The narrowest width at which `next` fits is where it ends when
+    // laid out flat, if that's within the limit.
+    int space_remaining = widths->limit - pos;
+    int threshold = fits_(next, stack.crbegin(), stack.crend(),
+                          space_remaining, aux_stack, true)
+            ? widths->limit - space_remaining
+            : widths->limit + 1;
+
+    if (width >= threshold) {
+        widths->lo = std::max(widths->lo, threshold);
+        return true;
+    } else {
+        widths->hi = std::min(widths->hi, threshold);
+        return false;
+    }
+}
+
+template<class Annot>
+bool
+annotated_document<Annot>::render_state_::fits_(
         cmd_ next,
-        const cmd_stack_& todo,
-        cmd_stack_& stack,
-        int space_remaining)
+        typename cmd_stack_::const_reverse_iterator todo_begin,
+        typename cmd_stack_::const_reverse_iterator todo_end,
+        int& space_remaining,
+        cmd_stack_& scratch,
+        bool elide)
 {
-    auto todo_begin = todo.rbegin();
-    auto todo_end   = todo.rend();
-    stack.clear();
-    stack.push_back(next);
+    scratch.clear();
+    scratch.push_back(next);
+    if (elide) fits_elide_levels.clear();
+
+    // How many elidable documents being rendered enclose the command the
+    // scratch stack started from. `next` is inside all of them, but a
+    // command from `todo` only in those that began below it on the stack.
+    size_t base_depth = elide_levels.size();
 
     while (space_remaining >= 0) {
-        if (stack.empty()) {
+        // Give up on the lookahead when cancelled; the caller stops next.
+        if (tick()) return true;
+
+        if (scratch.empty()) {
             if (todo_begin == todo_end) return true;
-            else stack.push_back(*todo_begin++);
+
+            size_t index = size_t(stack.crend() - todo_begin) - 1;
+            base_depth = size_t(std::upper_bound(elide_levels.begin(),
+                                                 elide_levels.end(), index)
+                                - elide_levels.begin());
+            scratch.push_back(*todo_begin++);
         } else {
-            cmd_ cmd {stack.back()};
-            stack.pop_back();
+            cmd_ cmd {scratch.back()};
+            scratch.pop_back();
 
             struct Fits_visitor
             {
                 const cmd_& cmd;
                 cmd_stack_& stack;
                 int& space_remaining;
+                render_state_& state;
+                bool elide;
+                size_t base_depth;
 
                 bool operator()(nil_) const
                 {
@@ -288,13 +1172,25 @@ annotated_document<Annot>::fits(
                     return false;
                 }
 
-                bool operator()(line_ line) const
+                bool operator()(escaped_ text) const
                 {
-                    switch (cmd.mode) {
-                        case mode_::breaking:
-                            return true;
-                        case mode_::flat:
-                            if (!line.no_space) --space_remaining;
+                    space_remaining -= text.size;
+                    return false;
+                }
+
+                bool operator()(const number_& number) const
+                {
+                    space_remaining -= number.size;
+                    return false;
+                }
+
+                bool operator()(line_ line) const
+                {
+                    switch (cmd.mode) {
+                        case mode_::breaking:
+                            return true;
+                        case mode_::flat:
+                            if (!line.no_space) --space_remaining;
                             return false;
                     }
                 }
@@ -322,11 +1218,58 @@ annotated_document<Annot>::fits(
                     stack.push_back(cmd_{ cmd.indent, cmd.mode, &annot.document });
                     return false;
                 }
+
+                bool operator()(const span_& span) const
+                {
+                    stack.push_back(cmd_{ cmd.indent, cmd.mode, &span.document });
+                    return false;
+                }
+
+                bool operator()(const source_& source) const
+                {
+                    stack.push_back(cmd_{ cmd.indent, cmd.mode, &source.document });
+                    return false;
+                }
+
+                bool operator()(const elide_& e) const
+                {
+                    auto& levels = state.fits_elide_levels;
+                    if (elide && state.elides(e, base_depth + levels.size())) {
+                        stack.push_back(cmd_{cmd.indent, cmd.mode, &e.placeholder});
+                    } else {
+                        if (elide) levels.push_back(stack.size());
+                        stack.push_back(cmd_{cmd.indent, cmd.mode, &e.document});
+                    }
+                    return false;
+                }
+
+                bool operator()(const lazy_& lazy) const
+                {
+                    auto& lookahead = state.lookahead;
+                    auto forced = std::find_if(
+                            lookahead.begin(), lookahead.end(),
+                            [&](const forced_& f) { return f.node == &lazy; });
+
+                    if (forced == lookahead.end()) {
+                        lookahead.push_back(forced_{ &lazy, generate_(lazy) });
+                        forced = lookahead.end() - 1;
+                    }
+
+                    stack.push_back(cmd_{ cmd.indent, cmd.mode, forced->doc.get() });
+                    return false;
+                }
             };
 
-            if (std::visit(Fits_visitor{cmd, stack, space_remaining},
+            if (std::visit(Fits_visitor{cmd, scratch, space_remaining,
+                                        *this, elide, base_depth},
                            *cmd.doc->pimpl_))
                 return true;
+
+            if (elide) {
+                while (!fits_elide_levels.empty() &&
+                       fits_elide_levels.back() == scratch.size())
+                    fits_elide_levels.pop_back();
+            }
         }
     }
 
@@ -338,24 +1281,599 @@ template <class Renderer>
 void annotated_document<Annot>::render(
         Renderer& out, const int width) const
 {
-    int pos { 0 };
-    cmd_stack_ stack { cmd_{ 0, mode_::breaking, this } };
-    cmd_stack_ aux_stack;
-    std::vector<size_t> annot_stack;
+    render_state_ state(*this, width);
+    while (!state.done()) state.step(out);
+}
+
+template <class Annot>
+template <class Renderer>
+render_status annotated_document<Annot>::render(
+        Renderer& out, const int width, const render_options& options) const
+{
+    render_state_ state(*this, width);
+    state.max_depth = options.max_depth;
+    state.max_flat_width = options.max_flat_width;
+
+    if (options.cancel || options.deadline != state.deadline) {
+        state.cancel = options.cancel;
+        state.deadline = options.deadline;
+        state.check_interval = std::max(size_t(1), options.check_interval);
+        state.countdown = state.check_interval;
+    }
+
+    detail::limiting_renderer<Renderer> limited(out, options.max_lines,
+                                                options.max_bytes);
+
+    for (size_t nodes = 0; !state.done() && nodes < options.max_nodes; ++nodes) {
+        if (state.tick()) break;
+        state.step(limited);
+        if (limited.exhausted() || state.cancelled) break;
+    }
+
+    if (state.done() && !limited.exhausted() && !state.cancelled)
+        return render_status::complete;
+
+    limited.finish(options.ellipsis);
+    state.close(out);
+    return state.cancelled ? render_status::cancelled
+                           : render_status::truncated;
+}
+
+template <class Annot>
+template <class Renderer>
+void annotated_document<Annot>::render(
+        Renderer& out, const int width, source_map& map) const
+{
+    render_state_ state(*this, width);
+    state.map_sources = true;
+
+    detail::source_mapping_renderer<Renderer> mapping(out, map);
+
+    while (!state.done()) {
+        mapping.source = state.source_stack.empty()
+                ? source_map::no_source : state.source_stack.back().id;
+        state.step(mapping);
+    }
+}
+
+template <class Annot>
+annotated_document<Annot>::render_state_::render_state_(
+        const annotated_document& doc, int width)
+        : render_state_(width, 0,
+                        cmd_stack_{ { cmd_{ 0, mode_::breaking, &doc } },
+                                    get_memory_resource() })
+{ }
+
+template <class Annot>
+annotated_document<Annot>::render_state_::render_state_(
+        int width, int pos, cmd_stack_ stack)
+        : width(width)
+        , pos(pos)
+        , stack(std::move(stack))
+        , aux_stack(get_memory_resource())
+        , annot_stack(get_memory_resource())
+        , lookahead(get_memory_resource())
+        , pieces(get_memory_resource())
+        , elide_levels(get_memory_resource())
+        , fits_elide_levels(get_memory_resource())
+        , measure_stack(get_memory_resource())
+        , span_stack(get_memory_resource())
+        , source_stack(get_memory_resource())
+{ }
+
+template <class Annot>
+bool annotated_document<Annot>::render_state_::poll()
+{
+    countdown = check_interval;
+    cancelled = cancelled ||
+                (cancel && cancel->load(std::memory_order_relaxed)) ||
+                std::chrono::steady_clock::now() >= deadline;
+    return cancelled;
+}
+
+template <class Annot>
+bool annotated_document<Annot>::render_state_::elides(const elide_& e,
+                                                      size_t depth)
+{
+    if (depth >= max_depth) return true;
+    if (max_flat_width == SIZE_MAX) return false;
+
+    // Measuring stops one column past the budget, so it forces only as
+    // much of the document as that takes.
+    int budget = int(std::min(max_flat_width, size_t(INT_MAX)));
+    size_t forced = lookahead.size();
+    cmd_ whole { 0, mode_::flat, &e.document };
+    bool too_wide = !fits_(whole, stack.crend(), stack.crend(), budget,
+                           measure_stack, false);
+
+    // Nothing will reach what was forced inside an elided document.
+    if (too_wide) lookahead.erase(lookahead.begin() + long(forced),
+                                  lookahead.end());
+    return too_wide;
+}
+
+template <class Annot>
+auto annotated_document<Annot>::render_state_::force(const lazy_& lazy)
+        -> forced_ptr_
+{
+    for (auto i = lookahead.begin(); i != lookahead.end(); ++i) {
+        if (i->node == &lazy) {
+            forced_ptr_ result = std::move(i->doc);
+            lookahead.erase(i);
+            return result;
+        }
+    }
+
+    return generate_(lazy);
+}
+
+template <class Annot>
+auto annotated_document<Annot>::generate_(const lazy_& lazy) -> forced_ptr_
+{
+    return std::allocate_shared<annotated_document>(
+            std::pmr::polymorphic_allocator<annotated_document>(
+                    get_memory_resource()),
+            lazy.generate());
+}
+
+template <class Annot>
+template <class Renderer>
+void annotated_document<Annot>::render_state_::step(Renderer& out)
+{
+    cmd_ cmd = stack.back();
+    stack.pop_back();
+
+    struct Render_visitor
+    {
+        int& pos;
+        const int width;
+        cmd_& cmd;
+        cmd_stack_& stack;
+        render_state_& state;
+        std::pmr::vector<open_annot_>& annot_stack;
+        Renderer& out;
+
+        void operator()(nil_) const
+        { }
+
+        void operator()(const append_& app) const
+        {
+            stack.push_back(cmd_{cmd.indent, cmd.mode, &app.second});
+            stack.push_back(cmd_{cmd.indent, cmd.mode, &app.first});
+        }
+
+        void operator()(const owned_text_& text) const
+        {
+            out.write(text.s);
+            pos += text.size;
+        }
+
+        void operator()(borrowed_text_ text) const {
+            out.write(text.sv);
+            pos += text.size;
+        }
+
+        void operator()(escaped_ text) const
+        {
+            detail::write_escaped(out, text.sv, text.style);
+            pos += text.size;
+        }
+
+        void operator()(const number_& number) const
+        {
+            out.write(std::string_view(number.digits, number.size));
+            pos += number.size;
+        }
+
+        void operator()(line_ line) const
+        {
+            switch (cmd.mode) {
+                case mode_::breaking:
+                    out.newline(cmd.indent);
+                    pos = cmd.indent;
+                    break;
+                case mode_::flat:
+                    if (!line.no_space) {
+                        out.write(' ');
+                        ++pos;
+                    }
+                    break;
+            }
+        }
+
+        void operator()(const group_& group) const
+        {
+            cmd_ next { cmd.indent, mode_::flat, &group.document };
+
+            if (cmd.mode == mode_::breaking && !state.fits(next))
+                next.mode = mode_::breaking;
+
+            stack.push_back(next);
+        }
+
+        void operator()(const nest_& nest) const
+        {
+            stack.push_back(cmd_{cmd.indent + nest.amount, cmd.mode, &nest.document});
+        }
+
+        void operator()(const align_& align) const
+        {
+            stack.push_back(cmd_{pos, cmd.mode, &align.document});
+        }
+
+        void operator()(const annot_& annot) const
+        {
+            out.push_annotation(annot.annot);
+            annot_stack.push_back(open_annot_{stack.size(), &annot.annot});
+            stack.push_back(cmd_{cmd.indent, cmd.mode, &annot.document});
+        }
+
+        void operator()(const span_& span) const
+        {
+            state.span_stack.push_back(open_span_{stack.size(), &span});
+            stack.push_back(cmd_{cmd.indent, cmd.mode, &span.document});
+        }
+
+        void operator()(const source_& source) const
+        {
+            if (state.map_sources)
+                state.source_stack.push_back(open_source_{stack.size(), source.id});
+            stack.push_back(cmd_{cmd.indent, cmd.mode, &source.document});
+        }
+
+        void operator()(const elide_& elide) const
+        {
+            if (state.elides(elide, state.elide_levels.size())) {
+                stack.push_back(cmd_{cmd.indent, cmd.mode, &elide.placeholder});
+            } else {
+                state.elide_levels.push_back(stack.size());
+                stack.push_back(cmd_{cmd.indent, cmd.mode, &elide.document});
+            }
+        }
+
+        void operator()(const lazy_& lazy) const
+        {
+            forced_ptr_ doc = state.force(lazy);
+
+            // If this was the last command left from an enclosing forced
+            // document, that can go now, which is what keeps a chain of
+            // lazy documents from accumulating.
+            auto& pieces = state.pieces;
+            while (!pieces.empty() && pieces.back().level >= stack.size())
+                pieces.pop_back();
+
+            stack.push_back(cmd_{cmd.indent, cmd.mode, doc.get()});
+            pieces.push_back(piece_{ stack.size() - 1, std::move(doc) });
+        }
+    };
+
+    std::visit(Render_visitor{pos, width, cmd, stack,
+                              *this, annot_stack, out},
+               *cmd.doc->pimpl_);
+
+    while (!annot_stack.empty() && annot_stack.back().level == stack.size()) {
+        annot_stack.pop_back();
+        out.pop_annotation();
+    }
+
+    while (!pieces.empty() && pieces.back().level >= stack.size())
+        pieces.pop_back();
+
+    while (!elide_levels.empty() && elide_levels.back() == stack.size())
+        elide_levels.pop_back();
+
+    while (!span_stack.empty() && span_stack.back().level == stack.size())
+        span_stack.pop_back();
+
+    while (!source_stack.empty() && source_stack.back().level == stack.size())
+        source_stack.pop_back();
+}
+
+template <class Annot>
+template <class Renderer>
+void annotated_document<Annot>::render_state_::close(Renderer& out)
+{
+    while (!annot_stack.empty()) {
+        annot_stack.pop_back();
+        out.pop_annotation();
+    }
+}
+
+template <class Annot>
+auto annotated_document<Annot>::index_lines(
+        int width, size_t interval) const -> line_index
+{
+    interval = std::max(size_t(1), interval);
+
+    line_index index(width);
+    render_state_ state(*this, width);
+    detail::line_counter counter;
+
+    index.checkpoints_.push_back({0, state});
+
+    while (!state.done()) {
+        size_t before = counter.lines;
+        state.step(counter);
+
+        if (counter.lines != before && counter.lines % interval == 0) {
+            state.aux_stack.clear();
+            index.checkpoints_.push_back({counter.lines, state});
+        }
+    }
+
+    index.lines_ = counter.lines + 1;
+    return index;
+}
+
+template <class Annot>
+auto annotated_document<Annot>::layout(int width) const -> layout_result
+{
+    return layout_(width, nullptr);
+}
+
+template <class Annot>
+auto annotated_document<Annot>::layout_(int width, widths_* widths) const
+        -> layout_result
+{
+    layout_result result(width);
+    typename layout_result::recorder_ recorder{result};
+
+    render_state_ state(*this, width);
+    state.widths = widths;
+    while (!state.done()) state.step(recorder);
+
+    return result;
+}
+
+template <class Annot>
+auto annotated_document<Annot>::responsive(int max_width) const
+        -> responsive_layout
+{
+    return responsive_layout(*this, max_width);
+}
+
+template <class Annot>
+auto annotated_document<Annot>::responsive_layout::entry_at_(int width)
+        -> const entry_&
+{
+    auto next = std::upper_bound(
+            cache_.begin(), cache_.end(), width,
+            [](int w, const entry_& entry) { return w < entry.lo; });
+
+    if (next != cache_.begin() && width < std::prev(next)->hi)
+        return *std::prev(next);
+
+    widths_ widths { 0, INT_MAX, std::max(max_width_, width) };
+    layout_result layout = doc_.layout_(width, &widths);
+    return *cache_.insert(next, entry_{widths.lo, widths.hi, std::move(layout)});
+}
+
+template <class Annot>
+auto annotated_document<Annot>::responsive_layout::at(int width)
+        -> const layout_result&
+{
+    return entry_at_(width).layout;
+}
+
+template <class Annot>
+std::pair<int, int>
+annotated_document<Annot>::responsive_layout::interval(int width)
+{
+    const entry_& entry = entry_at_(width);
+    return {entry.lo, entry.hi};
+}
+
+template <class Annot>
+std::vector<int>
+annotated_document<Annot>::responsive_layout::breakpoints(int first, int last)
+{
+    std::vector<int> result;
+
+    for (int width = entry_at_(first).hi; width <= last;
+         width = entry_at_(width).hi)
+        result.push_back(width);
+
+    return result;
+}
+
+template <class Annot>
+void annotated_document<Annot>::layout_result::recorder_::append(
+        const char* s, size_t n)
+{
+    if (n == 0) return;
+
+    if (result.ops_.empty() || result.ops_.back().kind != op_kind_::text)
+        result.ops_.push_back(op_{op_kind_::text, 0});
+
+    result.ops_.back().arg += n;
+    result.text_.append(s, n);
+}
+
+template <class Annot>
+void annotated_document<Annot>::layout_result::recorder_::newline(int indent)
+{
+    result.ops_.push_back(op_{op_kind_::newline, size_t(indent)});
+    ++result.lines_;
+}
+
+template <class Annot>
+void annotated_document<Annot>::layout_result::recorder_::push_annotation(
+        const annot_type& annot)
+{
+    result.ops_.push_back(op_{op_kind_::push, 0});
+    result.annots_.push_back(annot);
+}
+
+template <class Annot>
+void annotated_document<Annot>::layout_result::recorder_::pop_annotation()
+{
+    result.ops_.push_back(op_{op_kind_::pop, 0});
+}
+
+template <class Annot>
+template <class Renderer>
+void annotated_document<Annot>::layout_result::replay(Renderer& out) const
+{
+    const char* text = text_.data();
+    auto annot = annots_.begin();
+
+    for (const op_& op : ops_) {
+        switch (op.kind) {
+            case op_kind_::text:
+                out.write(std::string_view(text, op.arg));
+                text += op.arg;
+                break;
+            case op_kind_::newline:
+                out.newline(int(op.arg));
+                break;
+            case op_kind_::push:
+                out.push_annotation(*annot++);
+                break;
+            case op_kind_::pop:
+                out.pop_annotation();
+                break;
+        }
+    }
+}
+
+template <class Annot>
+template <class Renderer>
+void annotated_document<Annot>::layout_result::replay(
+        Renderer& out, size_t first, size_t count) const
+{
+    if (count == 0 || first >= lines_) return;
+
+    const size_t last = first + std::min(count, lines_ - first);
+    const char* text = text_.data();
+    auto annot = annots_.begin();
+    std::vector<const annot_type*> open;
+    size_t line = 0;
+
+    for (const op_& op : ops_) {
+        bool in_range = line >= first;
+
+        switch (op.kind) {
+            case op_kind_::text:
+                if (in_range) out.write(std::string_view(text, op.arg));
+                text += op.arg;
+                break;
+
+            case op_kind_::newline:
+                if (++line == last) break;
+
+                if (line == first) {
+                    for (const annot_type* each : open)
+                        out.push_annotation(*each);
+                    if (op.arg > 0) out.write(std::string(op.arg, ' '));
+                } else if (in_range) {
+                    out.newline(int(op.arg));
+                }
+                break;
+
+            case op_kind_::push:
+                open.push_back(&*annot);
+                if (in_range) out.push_annotation(*annot);
+                ++annot;
+                break;
+
+            case op_kind_::pop:
+                open.pop_back();
+                if (in_range) out.pop_annotation();
+                break;
+        }
+
+        if (line == last) break;
+    }
+
+    for (size_t i = 0; i < open.size(); ++i)
+        out.pop_annotation();
+}
+
+template <class Annot>
+template <class Renderer>
+void annotated_document<Annot>::line_index::render(
+        Renderer& out, size_t first, size_t count) const
+{
+    if (count == 0 || first >= lines_) return;
+
+    auto checkpoint = std::upper_bound(
+            checkpoints_.begin(), checkpoints_.end(), first,
+            [](size_t line, const checkpoint_& c) { return line < c.line; });
+    --checkpoint;
+
+    render_state_ state(checkpoint->state);
+    detail::line_counter counter;
+    counter.lines = checkpoint->line;
+
+    while (counter.lines < first) state.step(counter);
+
+    for (const open_annot_& open : state.annot_stack)
+        out.push_annotation(*open.annot);
+
+    if (state.pos > 0)
+        out.write(std::string(size_t(state.pos), ' '));
+
+    detail::limiting_renderer<Renderer> limited(out, count, SIZE_MAX);
+    while (!state.done() && !limited.exhausted()) state.step(limited);
+
+    limited.finish({});
+    state.close(out);
+}
+
+template <class Annot>
+auto annotated_document<Annot>::render_chunks(
+        int width, size_t chunk_size) const -> chunked_render
+{
+    return chunked_render(*this, width, chunk_size);
+}
+
+template <class Annot>
+annotated_document<Annot>::chunked_render::chunked_render(
+        const annotated_document& doc, int width, size_t chunk_size)
+        : state_(doc, width)
+        , chunk_size_(std::max(size_t(1), chunk_size))
+        , buffer_(std::make_unique<string_output>())
+        , renderer_(*buffer_)
+{ }
+
+template <class Annot>
+auto annotated_document<Annot>::chunked_render::next()
+        -> std::optional<std::string_view>
+{
+    std::string& buffer = buffer_->str;
+
+    if (offset_ == buffer.size()) {
+        buffer.clear();
+        offset_ = 0;
+
+        while (buffer.size() < chunk_size_ && !state_.done())
+            state_.step(renderer_);
+
+        if (buffer.empty()) return std::nullopt;
+    }
+
+    std::string_view chunk(buffer);
+    chunk = chunk.substr(offset_, chunk_size_);
+    offset_ += chunk.size();
+    return chunk;
+}
+
+template <class Annot>
+auto annotated_document<Annot>::split_forced_() const -> std::vector<segment_>
+{
+    std::vector<segment_> segments { segment_{ 0, {} } };
+    cmd_stack_ stack { { cmd_{ 0, mode_::breaking, this } },
+                       get_memory_resource() };
 
     while (!stack.empty()) {
         cmd_ cmd = stack.back();
         stack.pop_back();
 
-        struct Render_visitor
+        struct Split_visitor
         {
-            int& pos;
-            const int width;
-            cmd_& cmd;
+            const cmd_& cmd;
             cmd_stack_& stack;
-            cmd_stack_& aux_stack;
-            std::vector<size_t>& annot_stack;
-            Renderer& out;
+            std::vector<segment_>& segments;
 
             void operator()(nil_) const
             { }
@@ -366,70 +1884,224 @@ void annotated_document<Annot>::render(
                 stack.push_back(cmd_{cmd.indent, cmd.mode, &app.first});
             }
 
-            void operator()(const owned_text_& text) const
+            void operator()(line_) const
             {
-                out.write(text.s);
-                pos += text.size;
+                segments.push_back(segment_{ cmd.indent, {} });
             }
 
-            void operator()(borrowed_text_ text) const {
-                out.write(text.sv);
-                pos += text.size;
+            void operator()(const nest_& nest) const
+            {
+                stack.push_back(cmd_{cmd.indent + nest.amount, cmd.mode, &nest.document});
             }
 
-            void operator()(line_ line) const
+            // Everything else is laid out whole within its segment.
+
+            void operator()(const owned_text_&) const { keep(); }
+            void operator()(borrowed_text_) const { keep(); }
+            void operator()(escaped_) const { keep(); }
+            void operator()(const number_&) const { keep(); }
+            void operator()(const group_&) const { keep(); }
+            void operator()(const align_&) const { keep(); }
+            void operator()(const annot_&) const { keep(); }
+            void operator()(const lazy_&) const { keep(); }
+            void operator()(const elide_&) const { keep(); }
+            void operator()(const span_&) const { keep(); }
+            void operator()(const source_&) const { keep(); }
+
+            void keep() const
             {
-                switch (cmd.mode) {
-                    case mode_::breaking:
-                        out.newline(cmd.indent);
-                        pos = cmd.indent;
-                        break;
-                    case mode_::flat:
-                        if (!line.no_space) {
-                            out.write(' ');
-                            ++pos;
-                        }
-                        break;
-                }
+                segments.back().cmds.push_back(cmd);
             }
+        };
 
-            void operator()(const group_& group) const
-            {
-                cmd_ next { cmd.indent, mode_::flat, &group.document };
+        std::visit(Split_visitor{cmd, stack, segments}, *cmd.doc->pimpl_);
+    }
 
-                if (cmd.mode == mode_::breaking && !fits(next, stack, aux_stack, width - pos))
-                    next.mode = mode_::breaking;
+    return segments;
+}
 
-                stack.push_back(next);
-            }
+template <class Annot>
+auto annotated_document<Annot>::span_bounds_(const annotated_document& doc)
+        -> std::optional<std::pair<size_t, size_t>>
+{
+    std::pair<size_t, size_t> bounds { SIZE_MAX, 0 };
+    std::vector<const annotated_document*> todo { &doc };
 
-            void operator()(const nest_& nest) const
+    while (!todo.empty()) {
+        const annotated_document* next = todo.back();
+        todo.pop_back();
+
+        struct Bounds_visitor
+        {
+            std::vector<const annotated_document*>& todo;
+            std::pair<size_t, size_t>& bounds;
+
+            bool operator()(const span_& span) const
             {
-                stack.push_back(cmd_{cmd.indent + nest.amount, cmd.mode, &nest.document});
+                bounds.first  = std::min(bounds.first, span.begin);
+                bounds.second = std::max(bounds.second, span.end);
+                return true;
             }
 
-            void operator()(const align_& align) const
+            bool operator()(const lazy_&) const { return false; }
+
+            bool operator()(const append_& app) const
             {
-                stack.push_back(cmd_{pos, cmd.mode, &align.document});
+                todo.push_back(&app.second);
+                todo.push_back(&app.first);
+                return true;
             }
 
-            void operator()(const annot_& annot) const
+            bool operator()(const group_& g) const { return push(g.document); }
+            bool operator()(const nest_& n) const { return push(n.document); }
+            bool operator()(const align_& a) const { return push(a.document); }
+            bool operator()(const annot_& a) const { return push(a.document); }
+            bool operator()(const source_& s) const { return push(s.document); }
+
+            bool operator()(const elide_& e) const
             {
-                out.push_annotation(annot.annot);
-                annot_stack.push_back(stack.size());
+                push(e.placeholder);
+                return push(e.document);
+            }
+
+            bool operator()(const owned_text_&) const { return true; }
+            bool operator()(borrowed_text_) const { return true; }
+            bool operator()(escaped_) const { return true; }
+            bool operator()(const number_&) const { return true; }
+            bool operator()(nil_) const { return true; }
+            bool operator()(line_) const { return true; }
 
+            bool push(const annotated_document& doc) const
+            {
+                todo.push_back(&doc);
+                return true;
             }
         };
 
-        std::visit(Render_visitor{pos, width, cmd, stack,
-                                  aux_stack, annot_stack, out},
-                   *cmd.doc->pimpl_);
+        if (!std::visit(Bounds_visitor{todo, bounds}, *next->pimpl_))
+            return std::nullopt;
+    }
+
+    return bounds;
+}
+
+template <class Annot>
+template <class Renderer>
+std::pair<size_t, size_t> annotated_document<Annot>::render_range(
+        Renderer& out, const int width, size_t begin, size_t end) const
+{
+    const std::vector<segment_> segments = split_forced_();
 
-        if (!annot_stack.empty() && annot_stack.back() == stack.size()) {
-            annot_stack.pop_back();
-            out.pop_annotation();
+    auto may_overlap = [&](const segment_& segment) {
+        for (const cmd_& cmd : segment.cmds) {
+            auto bounds = span_bounds_(*cmd.doc);
+            if (!bounds || (bounds->first < end && begin < bounds->second))
+                return true;
+        }
+        return false;
+    };
+
+    // Only the segments from the first to the last that may overlap are
+    // laid out.
+    size_t first = 0;
+    while (first < segments.size() && !may_overlap(segments[first])) ++first;
+    if (first == segments.size()) return {0, 0};
+
+    size_t last = segments.size();
+    while (!may_overlap(segments[last - 1])) --last;
+
+    layout_result layout(width);
+    typename layout_result::recorder_ recorder{layout};
+    size_t first_line = SIZE_MAX, last_line = 0;
+    std::pair<size_t, size_t> covered { SIZE_MAX, 0 };
+
+    for (size_t i = first; i < last; ++i) {
+        const segment_& segment = segments[i];
+
+        // The first segment's indentation is kept as an empty line before
+        // it, which is never rendered.
+        if (i > 0) recorder.newline(segment.indent);
+
+        render_state_ state(width, segment.indent,
+                            cmd_stack_(segment.cmds.rbegin(),
+                                       segment.cmds.rend(),
+                                       get_memory_resource()));
+
+        while (!state.done()) {
+            const span_* span = state.span_stack.empty()
+                    ? nullptr : state.span_stack.back().span;
+            size_t before = layout.text_.size();
+
+            state.step(recorder);
+
+            bool wrote = layout.text_.size() != before;
+            if (wrote && span && span->begin < end && begin < span->end) {
+                first_line = std::min(first_line, layout.lines_ - 1);
+                last_line  = std::max(last_line, layout.lines_ - 1);
+                covered.first  = std::min(covered.first, span->begin);
+                covered.second = std::max(covered.second, span->end);
+            }
         }
     }
+
+    if (first_line == SIZE_MAX) return {0, 0};
+
+    layout.replay(out, first_line, last_line - first_line + 1);
+    return covered;
+}
+
+template <class Annot>
+template <class MakeRenderer>
+void annotated_document<Annot>::render_parallel(
+        std::ostream& out, const int width, unsigned threads,
+        MakeRenderer make_renderer) const
+{
+    const std::vector<segment_> segments = split_forced_();
+
+    // Segments are often single lines, so hand them out in runs. Runs are
+    // capped in length, and only a few are buffered at a time, so memory
+    // stays bounded however long the document.
+    const unsigned workers = detail::worker_count(threads, segments.size());
+    const size_t run = std::clamp(segments.size() / (size_t(workers) * 8),
+                                  size_t(1), size_t(256));
+    const size_t jobs = (segments.size() + run - 1) / run;
+    std::vector<detail::job_output> buffers(size_t(workers) * 2);
+
+    auto work = [&](unsigned, size_t job) {
+        detail::job_output& buffer = buffers[job % buffers.size()];
+        buffer.text.clear();
+        auto renderer = make_renderer(buffer.stream);
+
+        size_t begin = job * run;
+        size_t end   = std::min(segments.size(), begin + run);
+
+        for (size_t i = begin; i < end; ++i) {
+            const segment_& segment = segments[i];
+            if (i > 0) renderer.newline(segment.indent);
+
+            render_state_ state(width, segment.indent,
+                                cmd_stack_(segment.cmds.rbegin(),
+                                           segment.cmds.rend(),
+                                           get_memory_resource()));
+            while (!state.done()) state.step(renderer);
+        }
+    };
+
+    auto emit = [&](size_t job) {
+        const std::string& text = buffers[job % buffers.size()].text;
+        out.write(text.data(), std::streamsize(text.size()));
+    };
+
+    detail::ordered_for(jobs, workers, buffers.size(), work, emit);
+}
+
+template <class Annot>
+void annotated_document<Annot>::render_parallel(
+        std::ostream& out, const int width, unsigned threads) const
+{
+    render_parallel(out, width, threads, [](std::ostream& buffer) {
+        return no_annotation_renderer<>(buffer);
+    });
 }
 
 }
@@ -1,7 +1,10 @@
 #pragma once
 
+#include "scan.h"
+
 #include <algorithm>
 #include <cassert>
+#include <optional>
 #include <ostream>
 #include <string>
 #include <string_view>
@@ -9,6 +12,16 @@
 
 namespace pretty {
 
+/// An output that accumulates into a string.
+struct string_output
+{
+    /// The output so far.
+    std::string str;
+
+    /// Appends `n` bytes starting at `s`.
+    void write(const char* s, size_t n) { str.append(s, n); }
+};
+
 namespace detail {
 
 template<class Output = std::ostream>
@@ -30,6 +43,52 @@ public:
     void newline(int indent);
 };
 
+// Discards output, counting line breaks.
+struct line_counter
+{
+    size_t lines = 0;
+
+    void write(std::string_view) {}
+    void write(char) {}
+    void newline(int) { ++lines; }
+
+    template<class Annot>
+    void push_annotation(const Annot&) {}
+    void pop_annotation() {}
+};
+
+// Forwards to another renderer until its line or byte budget runs out,
+// cutting the last text short if need be, and then becomes exhausted.
+// Annotations that end after that are held open until `finish`, so that
+// the ellipsis lands inside them.
+template<class Renderer>
+class limiting_renderer
+{
+public:
+    limiting_renderer(Renderer& out, size_t max_lines, size_t max_bytes);
+
+    void write(std::string_view sv);
+    void write(char c);
+    void newline(int indent);
+
+    template<class Annot>
+    void push_annotation(const Annot&);
+    void pop_annotation();
+
+    /// Whether output has been cut off.
+    bool exhausted() const { return exhausted_; }
+
+    /// Writes the ellipsis and closes held annotations.
+    void finish(std::string_view ellipsis);
+
+private:
+    Renderer& out_;
+    size_t newlines_left_;
+    size_t bytes_left_;
+    bool exhausted_;
+    size_t held_pops_ = 0;
+};
+
 }
 
 /// A renderer that ignores annotations.
@@ -61,7 +120,7 @@ private:
     using super = detail::base_renderer<Output>;
     using super::out_;
 
-    std::vector<AnnotText*> annot_stack_;
+    std::vector<const AnnotText*> annot_stack_;
 
 public:
     using super::base_renderer;
@@ -75,6 +134,173 @@ public:
     void pop_annotation();
 };
 
+/// A terminal text style, used as an annotation by `ansi_renderer`. Unset
+/// attributes are inherited from the enclosing annotation.
+struct ansi_style
+{
+    /// Colors from the 256-color palette (0–7 are the standard colors and
+    /// 8–15 their bright versions), or -1 for the terminal default.
+    std::optional<int> foreground;
+    std::optional<int> background;
+    std::optional<bool> bold;
+    std::optional<bool> italic;
+    std::optional<bool> underline;
+};
+
+namespace detail {
+
+// A fully resolved terminal style.
+struct sgr_state
+{
+    int foreground = -1;
+    int background = -1;
+    bool bold = false;
+    bool italic = false;
+    bool underline = false;
+
+    // Whether spaces look different in this style than in `other`.
+    bool shows_spaces_unlike(const sgr_state& other) const
+    {
+        return background != other.background || underline != other.underline;
+    }
+
+    bool operator==(const sgr_state& other) const
+    {
+        return foreground == other.foreground &&
+               background == other.background && bold == other.bold &&
+               italic == other.italic && underline == other.underline;
+    }
+
+    bool operator!=(const sgr_state& other) const { return !(*this == other); }
+};
+
+}
+
+/// A renderer for terminals that renders `ansi_style` annotations as ANSI
+/// SGR escape sequences. It tracks the style the terminal is in and, just
+/// before each text run, emits only the changes needed to reach the
+/// style of the innermost annotation, so nested and adjacent annotations
+/// with the same style cost nothing. Whitespace and indentation are
+/// written without changing style unless the change would show on spaces.
+/// Call `finish` after rendering to return the terminal to its default
+/// style.
+template<class Output = std::ostream>
+class ansi_renderer : detail::base_renderer<Output>
+{
+private:
+    using super = detail::base_renderer<Output>;
+    using super::out_;
+
+public:
+    using super::base_renderer;
+
+    /// Writes the given string.
+    void write(std::string_view sv);
+
+    /// Writes a single character.
+    void write(char c) { write(std::string_view(&c, 1)); }
+
+    /// Writes a newline followed by the given indentation.
+    void newline(int indent);
+
+    /// Enters an annotation.
+    void push_annotation(const ansi_style&);
+
+    /// Leaves an annotation.
+    void pop_annotation();
+
+    /// Returns the terminal to its default style.
+    void finish() { change_to_(detail::sgr_state{}); }
+
+private:
+    const detail::sgr_state& wanted_() const;
+    void change_to_(const detail::sgr_state&);
+
+    std::vector<detail::sgr_state> styles_;
+    detail::sgr_state current_;
+};
+
+/// A renderer for HTML that renders annotations, which must convert to
+/// `std::string_view`, as `<span class="...">` elements, and escapes
+/// `<`, `>`, `&` and `"` in text. Runs of text without those are copied
+/// to the output whole. Indentation is written as plain spaces, so the
+/// output is meant for a `<pre>` element.
+template<class Output = std::ostream>
+class html_renderer : detail::base_renderer<Output>
+{
+private:
+    using super = detail::base_renderer<Output>;
+    using super::out_;
+
+public:
+    using super::base_renderer;
+    using super::newline;
+
+    /// Writes the given string, escaped.
+    void write(std::string_view sv);
+
+    /// Writes a single character, escaped.
+    void write(char c) { write(std::string_view(&c, 1)); }
+
+    /// Enters an annotation.
+    template<class Class>
+    void push_annotation(const Class&);
+
+    /// Leaves an annotation.
+    void pop_annotation();
+};
+
+/// An annotation and the range of output, in bytes, that it covers.
+template<class Annot>
+struct annotation_span
+{
+    size_t begin;
+    size_t end;
+    Annot annot;
+};
+
+/// A renderer that writes plain text into a contiguous buffer and records
+/// annotations as a flat list of spans over it, rather than as inline
+/// markup. Spans are listed in the order they begin, outer before inner.
+template<class Annot>
+class span_recording_renderer
+{
+public:
+    /// Reserves room for `text_capacity` bytes of text and `span_capacity`
+    /// spans.
+    explicit span_recording_renderer(size_t text_capacity = 0,
+                                     size_t span_capacity = 0);
+
+    /// Writes the given string.
+    void write(std::string_view sv) { text_.append(sv); }
+
+    /// Writes a single character.
+    void write(char c) { text_.push_back(c); }
+
+    /// Writes a newline followed by the given indentation.
+    void newline(int indent);
+
+    /// Enters an annotation.
+    void push_annotation(const Annot&);
+
+    /// Leaves an annotation.
+    void pop_annotation();
+
+    /// The text so far.
+    const std::string& text() const { return text_; }
+
+    /// The spans so far. A span's end is set when it is closed.
+    const std::vector<annotation_span<Annot>>& spans() const { return spans_; }
+
+    /// Empties the text and spans, keeping their storage for reuse.
+    void clear();
+
+private:
+    std::string text_;
+    std::vector<annotation_span<Annot>> spans_;
+    std::vector<size_t> open_;
+};
+
 /////
 ///// IMPLEMENTATION
 /////
@@ -108,6 +334,75 @@ base_renderer<Output>::newline(int indent)
     }
 }
 
+template<class Renderer>
+limiting_renderer<Renderer>::limiting_renderer(
+        Renderer& out, size_t max_lines, size_t max_bytes)
+        : out_(out)
+        , newlines_left_(max_lines == 0 ? 0 : max_lines - 1)
+        , bytes_left_(max_bytes)
+        , exhausted_(max_lines == 0)
+{ }
+
+template<class Renderer>
+void limiting_renderer<Renderer>::write(std::string_view sv)
+{
+    if (exhausted_) return;
+
+    if (sv.size() > bytes_left_) {
+        sv = sv.substr(0, bytes_left_);
+        exhausted_ = true;
+    }
+
+    bytes_left_ -= sv.size();
+    if (!sv.empty()) out_.write(sv);
+}
+
+template<class Renderer>
+void limiting_renderer<Renderer>::write(char c)
+{
+    write(std::string_view(&c, 1));
+}
+
+template<class Renderer>
+void limiting_renderer<Renderer>::newline(int indent)
+{
+    if (exhausted_) return;
+
+    size_t bytes = 1 + size_t(std::max(indent, 0));
+
+    if (newlines_left_ == 0 || bytes > bytes_left_) {
+        exhausted_ = true;
+        return;
+    }
+
+    --newlines_left_;
+    bytes_left_ -= bytes;
+    out_.newline(indent);
+}
+
+template<class Renderer>
+template<class Annot>
+void limiting_renderer<Renderer>::push_annotation(const Annot& annot)
+{
+    out_.push_annotation(annot);
+}
+
+template<class Renderer>
+void limiting_renderer<Renderer>::pop_annotation()
+{
+    if (exhausted_) ++held_pops_;
+    else out_.pop_annotation();
+}
+
+template<class Renderer>
+void limiting_renderer<Renderer>::finish(std::string_view ellipsis)
+{
+    out_.write(ellipsis);
+
+    for (; held_pops_ > 0; --held_pops_)
+        out_.pop_annotation();
+}
+
 }
 
 template<class Output>
@@ -135,4 +430,165 @@ void simple_annotation_renderer<AnnotText, Output>::pop_annotation()
     annot_stack_.pop_back();
 }
 
+template<class Annot>
+span_recording_renderer<Annot>::span_recording_renderer(
+        size_t text_capacity, size_t span_capacity)
+{
+    text_.reserve(text_capacity);
+    spans_.reserve(span_capacity);
+}
+
+template<class Annot>
+void span_recording_renderer<Annot>::newline(int indent)
+{
+    text_.push_back('\n');
+    text_.append(size_t(std::max(indent, 0)), ' ');
+}
+
+template<class Annot>
+void span_recording_renderer<Annot>::push_annotation(const Annot& annot)
+{
+    open_.push_back(spans_.size());
+    spans_.push_back(annotation_span<Annot>{text_.size(), text_.size(), annot});
+}
+
+template<class Annot>
+void span_recording_renderer<Annot>::pop_annotation()
+{
+    assert( !open_.empty() );
+    spans_[open_.back()].end = text_.size();
+    open_.pop_back();
+}
+
+template<class Annot>
+void span_recording_renderer<Annot>::clear()
+{
+    text_.clear();
+    spans_.clear();
+    open_.clear();
+}
+
+template<class Output>
+auto ansi_renderer<Output>::wanted_() const -> const detail::sgr_state&
+{
+    static const detail::sgr_state plain;
+    return styles_.empty() ? plain : styles_.back();
+}
+
+template<class Output>
+void ansi_renderer<Output>::write(std::string_view sv)
+{
+    bool blank = sv.find_first_not_of(" \t") == std::string_view::npos;
+
+    if (!blank || current_.shows_spaces_unlike(wanted_()))
+        change_to_(wanted_());
+
+    super::write(sv);
+}
+
+template<class Output>
+void ansi_renderer<Output>::newline(int indent)
+{
+    // Keep backgrounds and underlines off the end of the line and the
+    // indentation.
+    if (current_.shows_spaces_unlike(detail::sgr_state{})) {
+        detail::sgr_state plain = current_;
+        plain.background = -1;
+        plain.underline = false;
+        change_to_(plain);
+    }
+
+    super::newline(indent);
+}
+
+template<class Output>
+void ansi_renderer<Output>::push_annotation(const ansi_style& style)
+{
+    detail::sgr_state state = wanted_();
+    if (style.foreground) state.foreground = *style.foreground;
+    if (style.background) state.background = *style.background;
+    if (style.bold) state.bold = *style.bold;
+    if (style.italic) state.italic = *style.italic;
+    if (style.underline) state.underline = *style.underline;
+    styles_.push_back(state);
+}
+
+template<class Output>
+void ansi_renderer<Output>::pop_annotation()
+{
+    assert( !styles_.empty() );
+    styles_.pop_back();
+}
+
+template<class Output>
+void ansi_renderer<Output>::change_to_(const detail::sgr_state& next)
+{
+    if (next == current_) return;
+
+    std::string sgr = "\x1b[";
+
+    auto param = [&](int n) {
+        if (sgr.size() > 2) sgr += ';';
+        sgr += std::to_string(n);
+    };
+
+    auto color = [&](int c, int base) {
+        if (c < 0) param(base + 9);
+        else if (c < 8) param(base + c);
+        else if (c < 16) param(base + 60 + c - 8);
+        else {
+            param(base + 8);
+            param(5);
+            param(c);
+        }
+    };
+
+    if (next.bold != current_.bold) param(next.bold ? 1 : 22);
+    if (next.italic != current_.italic) param(next.italic ? 3 : 23);
+    if (next.underline != current_.underline) param(next.underline ? 4 : 24);
+    if (next.foreground != current_.foreground) color(next.foreground, 30);
+    if (next.background != current_.background) color(next.background, 40);
+
+    sgr += 'm';
+    out_.write(sgr.data(), sgr.size());
+    current_ = next;
+}
+
+template<class Output>
+void html_renderer<Output>::write(std::string_view sv)
+{
+    const char* p = sv.data();
+    const char* end = p + sv.size();
+
+    for (;;) {
+        const char* special = detail::find_html_special(p, end);
+        if (special != p) out_.write(p, size_t(special - p));
+        if (special == end) return;
+
+        switch (*special) {
+            case '<': out_.write("&lt;", 4); break;
+            case '>': out_.write("&gt;", 4); break;
+            case '&': out_.write("&amp;", 5); break;
+            default:  out_.write("&quot;", 6); break;
+        }
+
+        p = special + 1;
+    }
+}
+
+template<class Output>
+template<class Class>
+void html_renderer<Output>::push_annotation(const Class& name)
+{
+    out_.write("<span class=\"", 13);
+    write(std::string_view(name));
+    out_.write("\">", 2);
+}
+
+template<class Output>
+void html_renderer<Output>::pop_annotation()
+{
+    out_.write("</span>", 7);
+}
+
 }
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace pretty {
+
+namespace detail {
+
+// Word-at-a-time helpers: a word with every byte set to `c`, and a word
+// with the high bit set in (at least) the bytes of `x` that are zero.
+constexpr uint64_t broadcast(unsigned char c)
+{
+    return 0x0101010101010101ull * c;
+}
+
+constexpr uint64_t zero_bytes(uint64_t x)
+{
+    return (x - broadcast(1)) & ~x & broadcast(0x80);
+}
+
+// Returns the first of `< > & "` in `[p, end)`, or `end`. Sixteen bytes
+// are tested at a time with SSE2 where available, otherwise eight at a
+// time in a machine word.
+inline const char* find_html_special(const char* p, const char* end)
+{
+#if defined(__SSE2__)
+    const __m128i lt   = _mm_set1_epi8('<');
+    const __m128i gt   = _mm_set1_epi8('>');
+    const __m128i amp  = _mm_set1_epi8('&');
+    const __m128i quot = _mm_set1_epi8('"');
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i hits = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+                _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, quot)));
+
+        if (int mask = _mm_movemask_epi8(hits))
+            return p + __builtin_ctz(unsigned(mask));
+    }
+#endif
+
+    for (; end - p >= 8; p += 8) {
+        uint64_t x;
+        std::memcpy(&x, p, 8);
+
+        uint64_t hits = zero_bytes(x ^ broadcast('<')) |
+                        zero_bytes(x ^ broadcast('>')) |
+                        zero_bytes(x ^ broadcast('&')) |
+                        zero_bytes(x ^ broadcast('"'));
+        if (hits) break;
+    }
+
+    for (; p != end; ++p) {
+        if (*p == '<' || *p == '>' || *p == '&' || *p == '"') return p;
+    }
+
+    return end;
+}
+
+// Returns the first byte in `[p, end)` that a string literal must escape:
+// a control character, `"` or `\`, and DEL if `escape_del`; or `end`.
+inline const char* find_escape(const char* p, const char* end, bool escape_del)
+{
+#if defined(__SSE2__)
+    const __m128i space = _mm_set1_epi8(0x1f);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i del = _mm_set1_epi8(escape_del ? 0x7f : '"');
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i control = _mm_cmpeq_epi8(_mm_max_epu8(v, space), space);
+        __m128i hits = _mm_or_si128(
+                _mm_or_si128(control, _mm_cmpeq_epi8(v, del)),
+                _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                             _mm_cmpeq_epi8(v, backslash)));
+
+        if (int mask = _mm_movemask_epi8(hits))
+            return p + __builtin_ctz(unsigned(mask));
+    }
+#endif
+
+    const uint64_t del_word = broadcast(escape_del ? 0x7f : '"');
+
+    for (; end - p >= 8; p += 8) {
+        uint64_t x;
+        std::memcpy(&x, p, 8);
+
+        // Bytes below 0x20 are flagged like zero bytes, after subtracting
+        // 0x20 rather than 1.
+        uint64_t hits = ((x - broadcast(0x20)) & ~x & broadcast(0x80)) |
+                        zero_bytes(x ^ broadcast('"')) |
+                        zero_bytes(x ^ broadcast('\\')) |
+                        zero_bytes(x ^ del_word);
+        if (hits) break;
+    }
+
+    for (; p != end; ++p) {
+        auto c = static_cast<unsigned char>(*p);
+        if (c < 0x20 || c == '"' || c == '\\' || (escape_del && c == 0x7f))
+            return p;
+    }
+
+    return end;
+}
+
+}
+
+}
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace pretty {
+
+/// A mapping from rendered output back to source ids (see
+/// `annotated_document::with_source`), encoded like the "mappings" field
+/// of a JavaScript source map: lines are separated by ';' and segments
+/// by ','. Each segment is one or two Base64 VLQ numbers. The first is the
+/// byte column where the segment starts, relative to the previous segment
+/// on the line. The second, if present, is the source id, relative to
+/// the previous segment's id anywhere in the map. A segment without one
+/// starts output that maps to no source.
+class source_map
+{
+public:
+    /// The encoded mappings.
+    const std::string& mappings() const { return mappings_; }
+
+    /// The source id of the output at the given line and byte column,
+    /// counting from 0, or nothing if it has none. Decodes the map up to
+    /// that line.
+    std::optional<size_t> find(size_t line, size_t column) const;
+
+    /// Empties the map, keeping its storage for reuse.
+    void clear();
+
+    /// Starts a new line of output.
+    void newline();
+
+    /// Records that output from `column` on comes from `source`, or from
+    /// no source if `source` is `no_source`.
+    void map(size_t column, size_t source);
+
+    /// The source id of output that comes from no source.
+    static constexpr size_t no_source = SIZE_MAX;
+
+private:
+    void put_(int64_t);
+    static bool get_(std::string_view&, int64_t&);
+
+    std::string mappings_;
+    size_t column_ = 0;
+    size_t source_ = 0;
+    size_t current_ = no_source;
+};
+
+namespace detail {
+
+// Forwards to another renderer, recording the output of `source` in a
+// source map.
+template<class Renderer>
+class source_mapping_renderer
+{
+public:
+    source_mapping_renderer(Renderer& out, source_map& map)
+            : out_(out), map_(map)
+    { }
+
+    // The source id of what is written next.
+    size_t source = source_map::no_source;
+
+    void write(std::string_view sv)
+    {
+        if (sv.empty()) return;
+        map_.map(column_, source);
+        column_ += sv.size();
+        out_.write(sv);
+    }
+
+    void write(char c)
+    {
+        map_.map(column_, source);
+        ++column_;
+        out_.write(c);
+    }
+
+    void newline(int indent)
+    {
+        map_.newline();
+        column_ = size_t(std::max(indent, 0));
+        out_.newline(indent);
+    }
+
+    template<class Annot>
+    void push_annotation(const Annot& annot) { out_.push_annotation(annot); }
+    void pop_annotation() { out_.pop_annotation(); }
+
+private:
+    Renderer& out_;
+    source_map& map_;
+    size_t column_ = 0;
+};
+
+inline const char base64_digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+}
+
+/////
+///// IMPLEMENTATION
+/////
+
+inline void source_map::clear()
+{
+    mappings_.clear();
+    column_ = 0;
+    source_ = 0;
+    current_ = no_source;
+}
+
+inline void source_map::newline()
+{
+    mappings_ += ';';
+    column_ = 0;
+    current_ = no_source;
+}
+
+inline void source_map::map(size_t column, size_t source)
+{
+    if (source == current_) return;
+
+    // The first segment of a line is implicitly unmapped before it.
+    bool line_start = mappings_.empty() || mappings_.back() == ';';
+    if (source == no_source && line_start) return;
+
+    if (!line_start) mappings_ += ',';
+    put_(int64_t(column) - int64_t(column_));
+    column_ = column;
+
+    if (source != no_source) {
+        put_(int64_t(source) - int64_t(source_));
+        source_ = source;
+    }
+
+    current_ = source;
+}
+
+// Base64 VLQ: the sign in the lowest bit, then five bits per digit, low
+// digits first, with 32 set on all but the last.
+inline void source_map::put_(int64_t value)
+{
+    uint64_t vlq = value < 0 ? (uint64_t(-value) << 1) | 1
+                             : uint64_t(value) << 1;
+    do {
+        unsigned digit = vlq & 31;
+        vlq >>= 5;
+        if (vlq) digit |= 32;
+        mappings_ += detail::base64_digits[digit];
+    } while (vlq);
+}
+
+inline bool source_map::get_(std::string_view& in, int64_t& value)
+{
+    uint64_t vlq = 0;
+    unsigned shift = 0;
+
+    for (;;) {
+        if (in.empty()) return false;
+
+        const char* digit = std::char_traits<char>::find(
+                detail::base64_digits, 64, in.front());
+        if (!digit) return false;
+        in.remove_prefix(1);
+
+        unsigned bits = unsigned(digit - detail::base64_digits);
+        vlq |= uint64_t(bits & 31) << shift;
+        shift += 5;
+        if (!(bits & 32)) break;
+    }
+
+    value = vlq & 1 ? -int64_t(vlq >> 1) : int64_t(vlq >> 1);
+    return true;
+}
+
+inline std::optional<size_t> source_map::find(size_t line, size_t column) const
+{
+    std::string_view in = mappings_;
+    int64_t source = 0;
+
+    for (size_t current_line = 0; ; ++current_line) {
+        int64_t segment_column = 0;
+        std::optional<size_t> result;
+
+        while (!in.empty() && in.front() != ';') {
+            if (in.front() == ',') in.remove_prefix(1);
+
+            int64_t delta;
+            if (!get_(in, delta)) return std::nullopt;
+            segment_column += delta;
+
+            bool mapped = !in.empty() && in.front() != ',' && in.front() != ';';
+            if (mapped) {
+                if (!get_(in, delta)) return std::nullopt;
+                source += delta;
+            }
+
+            if (current_line == line && size_t(segment_column) <= column)
+                result = mapped ? std::optional<size_t>(size_t(source))
+                                : std::nullopt;
+        }
+
+        if (current_line == line || in.empty()) return result;
+        in.remove_prefix(1);
+    }
+}
+
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace pretty {
+
+namespace detail {
+
+inline unsigned worker_count(unsigned threads, size_t jobs)
+{
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    return unsigned(std::min(size_t(threads), std::max(size_t(1), jobs)));
+}
+
+// Calls `fn(worker, job)` for every `job` in `[0, jobs)` on `workers`
+// threads, the calling thread being worker 0. Jobs are handed out
+// dynamically, so a worker that finishes early takes the next one. The
+// first exception thrown by any job is rethrown after all workers join.
+template <class Fn>
+void parallel_for(size_t jobs, unsigned workers, Fn fn)
+{
+    std::atomic<size_t> next {0};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto work = [&](unsigned worker) {
+        try {
+            for (size_t job; (job = next++) < jobs; )
+                fn(worker, job);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) error = std::current_exception();
+            next = jobs;
+        }
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(workers - 1);
+    for (unsigned worker = 1; worker < workers; ++worker)
+        pool.emplace_back(work, worker);
+
+    work(0);
+
+    for (auto& thread : pool) thread.join();
+    if (error) std::rethrow_exception(error);
+}
+
+// Calls `work(worker, job)` for every `job` in `[0, jobs)` on `workers`
+// threads, and `emit(job)` on the calling thread for each job in order as
+// soon as it and all earlier jobs are done, so output drains while work
+// continues. At most `window` jobs are taken but not yet emitted, so their
+// results can live in `window` slots indexed by `job % window`. The
+// calling thread is worker 0 and works whenever it has nothing to emit.
+// The first exception thrown by either function is rethrown after all
+// workers join.
+template <class Work, class Emit>
+void ordered_for(size_t jobs, unsigned workers, size_t window,
+                 Work work, Emit emit)
+{
+    window = std::max(size_t(1), window);
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<char> done(window);
+    size_t next = 0, emitted = 0;
+    std::exception_ptr error;
+
+    auto fail = [&] {
+        if (!error) error = std::current_exception();
+        cv.notify_all();
+    };
+
+    auto claimable = [&] { return next < jobs && next < emitted + window; };
+
+    auto run = [&](unsigned worker, std::unique_lock<std::mutex>& lock) {
+        size_t job = next++;
+        lock.unlock();
+
+        try {
+            work(worker, job);
+            lock.lock();
+        } catch (...) {
+            lock.lock();
+            fail();
+        }
+
+        done[job % window] = true;
+        cv.notify_all();
+    };
+
+    auto background = [&](unsigned worker) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        for (;;) {
+            cv.wait(lock, [&] { return error || next == jobs || claimable(); });
+            if (error || next == jobs) return;
+            run(worker, lock);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(workers - 1);
+    for (unsigned worker = 1; worker < workers; ++worker)
+        pool.emplace_back(background, worker);
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (emitted < jobs && !error) {
+            char& ready = done[emitted % window];
+
+            if (ready) {
+                ready = false;
+                lock.unlock();
+
+                try {
+                    emit(emitted);
+                    lock.lock();
+                } catch (...) {
+                    lock.lock();
+                    fail();
+                    break;
+                }
+
+                // The slot is free only now that `emit` is done with it.
+                ++emitted;
+                cv.notify_all();
+            } else if (claimable()) {
+                run(0, lock);
+            } else {
+                cv.wait(lock);
+            }
+        }
+    }
+
+    for (auto& thread : pool) thread.join();
+    if (error) std::rethrow_exception(error);
+}
+
+// A stream that writes to a string whose capacity is kept from one use to
+// the next, so a job's output can be handed on without copying.
+class job_output : private std::streambuf
+{
+public:
+    job_output() : stream(this) { }
+
+    std::string text;
+    std::ostream stream;
+
+private:
+    int_type overflow(int_type c) override
+    {
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+            text += traits_type::to_char_type(c);
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override
+    {
+        text.append(s, size_t(n));
+        return n;
+    }
+};
+
+}
+
+}
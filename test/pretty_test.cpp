@@ -1,6 +1,16 @@
 #include "pretty.h"
+#include "parallel.h"
+#include "log_sink.h"
+#include "json.h"
+#include "incremental.h"
+#include "fragments.h"
 #include <catch.hpp>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdio>
 #include <memory>
+#include <memory_resource>
 #include <sstream>
 
 using namespace pretty;
@@ -94,3 +104,1409 @@ TEST_CASE("tree render")
                                      "     a[binary[[], []],\n"
                                      "       tree[[], []]]]");
 }
+
+class counting_resource : public std::pmr::memory_resource
+{
+public:
+    size_t allocated = 0;
+    size_t live = 0;
+    size_t peak = 0;
+
+private:
+    void* do_allocate(size_t bytes, size_t align) override
+    {
+        ++allocated;
+        peak = std::max(peak, ++live);
+        return std::pmr::new_delete_resource()->allocate(bytes, align);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t align) override
+    {
+        --live;
+        std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const
+    noexcept override
+    {
+        return this == &other;
+    }
+};
+
+TEST_CASE("memory resource scope")
+{
+    counting_resource counter;
+
+    {
+        memory_resource_scope scope(&counter);
+        CHECK( get_memory_resource() == &counter );
+
+        Tree tree = tree_cons("this",
+                              tree_cons("is"),
+                              tree_cons("a", tree_cons("binary")));
+        document doc = tree2doc(tree)
+                .append(document::text("a long owned string, not SSO"));
+        document copy = doc;
+
+        size_t before_render = counter.allocated;
+        CHECK( before_render > 0 );
+        CHECK( render_string(copy, 20) ==
+               "this[is[[], []],\n"
+               "     a[binary[[],\n"
+               "              []],\n"
+               "       []]]a long owned string, not SSO" );
+        CHECK( counter.allocated > before_render );
+    }
+
+    CHECK( get_memory_resource() == std::pmr::get_default_resource() );
+    CHECK( counter.live == 0 );
+}
+
+TEST_CASE("monotonic arena")
+{
+    std::byte buffer[1 << 12];
+    std::pmr::monotonic_buffer_resource arena(
+            buffer, sizeof buffer, std::pmr::null_memory_resource());
+    memory_resource_scope scope(&arena);
+
+    document d = document::text("hello")
+            .append(document::line())
+            .append(document::text("world"))
+            .group();
+
+    CHECK( render_string(d, 8) == "hello\nworld" );
+}
+
+TEST_CASE("parallel concat")
+{
+    std::vector<int> items(1000);
+    for (size_t i = 0; i < items.size(); ++i) items[i] = int(i);
+
+    auto item2doc = [](int i) {
+        return document::text(std::to_string(i))
+                .append(document::view(","))
+                .append(document::line())
+                .group();
+    };
+
+    document sequential;
+    for (int i : items)
+        sequential = sequential.move().append(item2doc(i));
+
+    document parallel = parallel_concat(items.begin(), items.end(),
+                                        item2doc, 4);
+    CHECK( render_string(parallel, 40) == render_string(sequential, 40) );
+
+    std::vector<std::pmr::unsynchronized_pool_resource> arenas(3);
+    std::vector<std::pmr::memory_resource*> resources;
+    for (auto& arena : arenas) resources.push_back(&arena);
+
+    document pooled = parallel_concat(items.begin(), items.end(),
+                                      item2doc, resources);
+    CHECK( render_string(pooled, 40) == render_string(sequential, 40) );
+
+    CHECK( render_string(parallel_concat(items.begin(), items.begin(),
+                                         item2doc), 40) == "" );
+}
+
+// An unsynchronized arena that notes any use from a thread other than the
+// one that made it.
+struct single_thread_resource : std::pmr::memory_resource
+{
+    std::pmr::unsynchronized_pool_resource pool;
+    std::thread::id owner = std::this_thread::get_id();
+    std::atomic<bool> foreign {false};
+
+    void* do_allocate(size_t bytes, size_t align) override
+    {
+        if (std::this_thread::get_id() != owner) foreign = true;
+        return pool.allocate(bytes, align);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t align) override
+    {
+        if (std::this_thread::get_id() != owner) foreign = true;
+        pool.deallocate(p, bytes, align);
+    }
+
+    bool do_is_equal(const memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+TEST_CASE("parallel concat in a scoped arena")
+{
+    std::vector<int> items(1000);
+    for (size_t i = 0; i < items.size(); ++i) items[i] = int(i);
+
+    // Yielding gives every worker a share even on a single core.
+    auto item2doc = [](int i) {
+        std::this_thread::yield();
+        return document::text(std::to_string(i)).append(document::line());
+    };
+
+    single_thread_resource arena;
+    std::string expected, actual;
+
+    {
+        memory_resource_scope scope(&arena);
+
+        document sequential;
+        for (int i : items)
+            sequential = sequential.move().append(item2doc(i));
+        expected = render_string(sequential, 40);
+
+        actual = render_string(parallel_concat(items.begin(), items.end(),
+                                               item2doc, 4), 40);
+    }
+
+    CHECK( actual == expected );
+    CHECK_FALSE( arena.foreign );
+}
+
+TEST_CASE("parallel render")
+{
+    Tree tree = tree_cons("this",
+                          tree_cons("is"),
+                          tree_cons("a", tree_cons("binary"), tree_cons("tree")));
+
+    document doc = document::text("trees:");
+    for (int i = 0; i < 50; ++i) {
+        doc = doc.move()
+                .append(document::line()
+                                .append(document::text(std::to_string(i)))
+                                .append(document::view(": "))
+                                .append(tree2doc(tree))
+                                .nest(2));
+    }
+
+    for (int width : {10, 30, 60}) {
+        std::ostringstream out;
+        doc.render_parallel(out, width, 4);
+        CHECK( out.str() == render_string(doc, width) );
+    }
+
+    std::ostringstream out;
+    document::text("one line").render_parallel(out, 80);
+    CHECK( out.str() == "one line" );
+
+    // Enough stretches that runs are capped and buffers are reused.
+    document many;
+    for (int i = 0; i < 20000; ++i) {
+        many = many.move()
+                .append(document::line())
+                .append(document::text(std::to_string(i)))
+                .append(document::view(": "))
+                .append(tree2doc(tree));
+    }
+
+    std::ostringstream many_out;
+    many.render_parallel(many_out, 30, 3);
+    CHECK( many_out.str() == render_string(many, 30) );
+}
+
+TEST_CASE("render batch")
+{
+    std::vector<Tree> trees;
+    std::vector<document> docs;
+    std::vector<std::string> expected;
+
+    for (int i = 0; i < 200; ++i) {
+        trees.push_back(tree_cons(std::to_string(i),
+                                  tree_cons("left"),
+                                  i % 2 ? tree_cons("right") : nullptr));
+        docs.push_back(tree2doc(trees.back()));
+        expected.push_back(render_string(docs.back(), 20));
+    }
+
+    std::vector<std::string> actual;
+    const auto caller = std::this_thread::get_id();
+    bool on_caller = true;
+    render_batch(docs.begin(), docs.end(), 20,
+                 [&](std::string_view sv) {
+                     actual.emplace_back(sv);
+                     on_caller &= std::this_thread::get_id() == caller;
+                 },
+                 4);
+
+    CHECK( actual == expected );
+    CHECK( on_caller );
+}
+
+std::string read_file(std::FILE* file)
+{
+    std::string result;
+    std::rewind(file);
+    for (int c; (c = std::getc(file)) != EOF; )
+        result += char(c);
+    return result;
+}
+
+TEST_CASE("log sink")
+{
+    std::FILE* file = std::tmpfile();
+    REQUIRE( file );
+
+    {
+        log_sink sink(fileno(file), 20);
+
+        std::vector<std::thread> producers;
+        for (int p = 0; p < 4; ++p) {
+            producers.emplace_back([&sink] {
+                for (int i = 0; i < 100; ++i) {
+                    sink.push(document::text("hello")
+                                      .append(document::line())
+                                      .append(document::text("world"))
+                                      .group());
+                    sink.push([] { return document::text("built"); });
+                }
+            });
+        }
+
+        for (auto& producer : producers) producer.join();
+        sink.flush();
+        CHECK( sink.queue_depth() == 0 );
+        CHECK( sink.dropped() == 0 );
+    }
+
+    std::string output = read_file(file);
+    std::fclose(file);
+
+    std::string hello = "hello world\n", built = "built\n";
+    CHECK( output.size() == 400 * (hello.size() + built.size()) );
+
+    size_t count = 0;
+    for (size_t pos = 0; (pos = output.find(hello, pos)) != std::string::npos;
+         pos += hello.size())
+        ++count;
+    CHECK( count == 400 );
+}
+
+TEST_CASE("log sink flushes under steady load")
+{
+    std::FILE* file = std::tmpfile();
+    REQUIRE( file );
+
+    using clock = std::chrono::steady_clock;
+    std::atomic<bool> stop {false};
+    auto give_up = clock::now() + std::chrono::seconds(8);
+
+    {
+        log_sink sink(fileno(file), 80);
+
+        // The producers outpace the render thread, so the queue never
+        // drains.
+        log_sink::builder_type slow = [] {
+            std::this_thread::sleep_for(std::chrono::microseconds(20));
+            return document::text("noise");
+        };
+
+        std::atomic<size_t> pushed {0};
+        std::vector<std::thread> producers;
+        for (int p = 0; p < 2; ++p) {
+            producers.emplace_back([&] {
+                while (!stop && clock::now() < give_up) {
+                    sink.push(slow);
+                    ++pushed;
+                }
+            });
+        }
+
+        while (pushed < 1000) std::this_thread::yield();
+
+        sink.push(document::text("marker"));
+        auto start = clock::now();
+        sink.flush();
+        auto waited = clock::now() - start;
+
+        CHECK( waited < std::chrono::seconds(5) );
+
+        stop = true;
+        for (auto& producer : producers) producer.join();
+    }
+
+    std::fclose(file);
+}
+
+TEST_CASE("log sink drops when full")
+{
+    std::FILE* file = std::tmpfile();
+    REQUIRE( file );
+
+    std::mutex gate;
+    std::unique_lock<std::mutex> hold(gate);
+
+    log_sink_options options;
+    options.capacity = 4;
+    options.overflow = overflow_policy::drop;
+    log_sink sink(fileno(file), 80, options);
+
+    // The first record stalls the render thread until we release the gate.
+    sink.push([&gate] {
+        std::lock_guard<std::mutex> lock(gate);
+        return document::text("first");
+    });
+
+    size_t accepted = 0;
+    for (int i = 0; i < 20; ++i)
+        if (sink.push(document::text("x"))) ++accepted;
+
+    CHECK( accepted <= 4 );
+    CHECK( sink.dropped() == 20 - accepted );
+
+    hold.unlock();
+    sink.flush();
+    std::string expected = "first\n";
+    for (size_t i = 0; i < accepted; ++i) expected += "x\n";
+    CHECK( read_file(file) == expected );
+    std::fclose(file);
+}
+
+TEST_CASE("async fd output")
+{
+    std::FILE* file = std::tmpfile();
+    REQUIRE( file );
+
+    document doc;
+    for (int i = 0; i < 500; ++i)
+        doc = doc.move()
+                .append(document::text(std::to_string(i)))
+                .append(document::line());
+    doc = doc.move().group();
+
+    async_output_options options;
+    options.buffer_size = 64;
+
+    {
+        async_fd_output output(fileno(file), options);
+        no_annotation_renderer<async_fd_output> renderer(output);
+        doc.render(renderer, 40);
+        output.finish();
+
+        CHECK( read_file(file) == render_string(doc, 40) );
+
+        output.write("more", 4);
+    }
+
+    CHECK( read_file(file) == render_string(doc, 40) + "more" );
+    std::fclose(file);
+}
+
+TEST_CASE("render chunks")
+{
+    Tree tree = tree_cons("this",
+                          tree_cons("is"),
+                          tree_cons("a", tree_cons("binary"), tree_cons("tree")));
+    document doc = tree2doc(tree);
+
+    for (size_t chunk_size : {1, 3, 7, 100}) {
+        auto chunks = doc.render_chunks(30, chunk_size);
+        std::string output;
+
+        while (auto chunk = chunks.next()) {
+            CHECK( chunk->size() <= chunk_size );
+            CHECK( !chunk->empty() );
+            output += *chunk;
+        }
+
+        CHECK( output == render_string(doc, 30) );
+        CHECK( !chunks.next() );
+    }
+}
+
+using annotated = annotated_document<std::pair<std::string, std::string>>;
+
+std::string render_annotated(const annotated& doc, int width)
+{
+    std::ostringstream out;
+    simple_annotation_renderer<std::string> renderer(out);
+    doc.render(renderer, width);
+    return out.str();
+}
+
+TEST_CASE("simple annotations")
+{
+    annotated doc = annotated::text("f")
+            .annotate("<b>", "</b>")
+            .append(annotated::text("(")
+                            .append(annotated::text("x")
+                                            .annotate("<i>", "</i>")
+                                            .annotate("<u>", "</u>"))
+                            .append(annotated::text(")")))
+            .annotate("[", "]");
+
+    CHECK( render_annotated(doc, 80) == "[<b>f</b>(<u><i>x</i></u>)]" );
+}
+
+document lazy_numbers(int from, int to, int* forced)
+{
+    return document::lazy([=] {
+        ++*forced;
+        if (from == to) return document();
+        return document::text(std::to_string(from))
+                .append(document::line())
+                .append(lazy_numbers(from + 1, to, forced));
+    });
+}
+
+TEST_CASE("lazy documents")
+{
+    document eager;
+    for (int i = 0; i < 20; ++i)
+        eager = eager.move()
+                .append(document::text(std::to_string(i)))
+                .append(document::line());
+    eager = eager.move().group();
+
+    int forced = 0;
+    document lazy = lazy_numbers(0, 20, &forced).group();
+    CHECK( forced == 0 );
+
+    CHECK( render_string(lazy, 100) == render_string(eager, 100) );
+    CHECK( forced == 21 );
+    CHECK( render_string(lazy, 10) == render_string(eager, 10) );
+
+    // Deciding the group only looks as far as the width.
+    forced = 0;
+    auto chunks = lazy.render_chunks(10, 1);
+    CHECK( chunks.next() == std::optional<std::string_view>("0") );
+    CHECK( forced < 8 );
+}
+
+TEST_CASE("lazy documents stream in bounded memory")
+{
+    counting_resource counter;
+    memory_resource_scope scope(&counter);
+
+    int forced = 0;
+    document doc = lazy_numbers(0, 10000, &forced);
+
+    size_t lines = 0;
+    auto chunks = doc.render_chunks(80, 64);
+    while (auto chunk = chunks.next())
+        lines += size_t(std::count(chunk->begin(), chunk->end(), '\n'));
+
+    CHECK( forced == 10001 );
+    CHECK( lines == 10000 );
+    CHECK( counter.allocated > 10000 );
+    CHECK( counter.peak < 20 );
+}
+
+TEST_CASE("json")
+{
+    const std::string input =
+            R"( {"name": "pretty++", "tags": ["c++", "wadler",
+                "leijen"], "stars": 1.5e3, "fork": false,
+                "empty": [], "none": {}, "quote": "say \"hi\""} )";
+
+    for (bool lazy : {true, false}) {
+        json_options options;
+        options.lazy = lazy;
+
+        std::istringstream in(input);
+        CHECK( render_string(json_document(in, options), 200) ==
+               R"({"name": "pretty++", "tags": ["c++", "wadler", "leijen"], )"
+               R"("stars": 1.5e3, "fork": false, "empty": [], "none": {}, )"
+               R"("quote": "say \"hi\""})" );
+
+        CHECK( render_string(json_document(input, options), 40) ==
+               "{\n"
+               "  \"name\": \"pretty++\",\n"
+               "  \"tags\": [\"c++\", \"wadler\", \"leijen\"],\n"
+               "  \"stars\": 1.5e3,\n"
+               "  \"fork\": false,\n"
+               "  \"empty\": [],\n"
+               "  \"none\": {},\n"
+               "  \"quote\": \"say \\\"hi\\\"\"\n"
+               "}" );
+    }
+
+    CHECK_THROWS_AS( render_string(json_document("[1, 2"), 80), json_error );
+    CHECK_THROWS_AS( render_string(json_document("[1 2]"), 80), json_error );
+    CHECK_THROWS_AS( render_string(json_document("{1: 2}"), 80), json_error );
+    CHECK_THROWS_AS( render_string(json_document("[] []"), 80), json_error );
+    CHECK_THROWS_AS( render_string(json_document("[foo]"), 80), json_error );
+    CHECK_THROWS_AS( render_string(json_document("[tru]"), 80), json_error );
+    CHECK_THROWS_AS( render_string(json_document("[1x2]"), 80), json_error );
+    CHECK_THROWS_AS( render_string(json_document("[-]"), 80), json_error );
+    CHECK_THROWS_AS( render_string(json_document("[01]"), 80), json_error );
+    CHECK_THROWS_AS( render_string(json_document("[1.]"), 80), json_error );
+    CHECK_THROWS_AS( render_string(json_document("[1e+]"), 80), json_error );
+    CHECK_THROWS_AS( render_string(json_document(R"("a\q")"), 80),
+                     json_error );
+    CHECK_THROWS_AS( render_string(json_document(R"("\u12g4")"), 80),
+                     json_error );
+    CHECK_THROWS_AS( render_string(json_document("\"a\tb\""), 80),
+                     json_error );
+
+    CHECK( render_string(json_document(R"([-0.5E-3, 0, "\u00e9\n\/"])"), 80)
+           == R"([-0.5E-3, 0, "\u00e9\n\/"])" );
+
+    json_options eager;
+    eager.lazy = false;
+    CHECK_THROWS_AS( json_document("[1, 2", eager), json_error );
+}
+
+TEST_CASE("json streams in bounded memory")
+{
+    std::string input = "[";
+    for (int i = 0; i < 5000; ++i) {
+        if (i > 0) input += ", ";
+        input += "{\"id\": " + std::to_string(i) + ", \"tags\": [1, 2, 3]}";
+    }
+    input += "]";
+
+    counting_resource counter;
+    memory_resource_scope scope(&counter);
+
+    document doc = json_document(input);
+
+    size_t lines = 0;
+    auto chunks = doc.render_chunks(40, 4096);
+    while (auto chunk = chunks.next())
+        lines += size_t(std::count(chunk->begin(), chunk->end(), '\n'));
+
+    CHECK( lines == 5001 );
+    CHECK( counter.peak < 200 );
+}
+
+document lazy_forever(int from)
+{
+    return document::lazy([=] {
+        return document::text(std::to_string(from))
+                .append(document::line())
+                .append(lazy_forever(from + 1));
+    });
+}
+
+std::string render_limited(const document& doc, int width,
+                           const render_options& options,
+                           render_status expected)
+{
+    std::ostringstream out;
+    no_annotation_renderer<> renderer(out);
+    CHECK( doc.render(renderer, width, options) == expected );
+    return out.str();
+}
+
+TEST_CASE("render limits")
+{
+    document forever = lazy_forever(0);
+
+    render_options lines;
+    lines.max_lines = 3;
+    CHECK( render_limited(forever, 80, lines, render_status::truncated)
+           == "0\n1\n2..." );
+
+    document hello = document::text("hello")
+            .append(document::line())
+            .append(document::text("world"));
+
+    render_options bytes;
+    bytes.max_bytes = 8;
+    bytes.ellipsis = " [more]";
+    CHECK( render_limited(document(hello).group(), 80, bytes,
+                          render_status::truncated)
+           == "hello wo [more]" );
+
+    render_options nodes;
+    nodes.max_nodes = 2;
+    CHECK( render_limited(hello, 80, nodes, render_status::truncated)
+           == "..." );
+    nodes.max_nodes = 4;
+    CHECK( render_limited(hello, 80, nodes, render_status::truncated)
+           == "hello\n..." );
+
+    render_options loose;
+    loose.max_lines = 2;
+    loose.max_bytes = 11;
+    CHECK( render_limited(hello, 80, loose, render_status::complete)
+           == "hello\nworld" );
+    loose.max_bytes = 10;
+    CHECK( render_limited(hello, 80, loose, render_status::truncated)
+           == "hello\nworl..." );
+}
+
+TEST_CASE("render limits close annotations")
+{
+    annotated doc = annotated::text("abc")
+            .append(annotated::text("defg").annotate("<", ">"))
+            .append(annotated::text("hij"))
+            .annotate("[", "]");
+
+    std::ostringstream out;
+    simple_annotation_renderer<std::string> renderer(out);
+    render_options options;
+    options.max_bytes = 8;
+
+    CHECK( doc.render(renderer, 80, options) == render_status::truncated );
+    CHECK( out.str() == "[abc<defg>h...]" );
+}
+
+TEST_CASE("layout replay")
+{
+    annotated doc = annotated::text("f(")
+            .append(annotated::text("alpha").annotate("<", ">"))
+            .append(annotated::text(","))
+            .append(annotated::line())
+            .append(annotated::view("beta"))
+            .append(annotated::text(")"))
+            .nest(2)
+            .group();
+
+    for (int width : {4, 40}) {
+        auto layout = doc.layout(width);
+        CHECK( layout.width() == width );
+
+        std::ostringstream plain, marked;
+        no_annotation_renderer<> plain_renderer(plain);
+        simple_annotation_renderer<std::string> marked_renderer(marked);
+        layout.replay(plain_renderer);
+        layout.replay(marked_renderer);
+
+        CHECK( marked.str() == render_annotated(doc, width) );
+        CHECK( plain.str() == (width == 4 ? "f(alpha,\n  beta)"
+                                          : "f(alpha, beta)") );
+    }
+
+    // Forced lazy text is copied, so the layout outlives the document.
+    int forced = 0;
+    auto layout = document(lazy_numbers(0, 3, &forced)).layout(80);
+    CHECK( forced == 4 );
+
+    std::ostringstream out;
+    no_annotation_renderer<> renderer(out);
+    layout.replay(renderer);
+    CHECK( out.str() == "0\n1\n2\n" );
+}
+
+TEST_CASE("responsive layout")
+{
+    Tree tree = tree_cons("aaa",
+                          tree_cons("bbbbb", tree_cons("ccc"), tree_cons("dd")),
+                          tree_cons("ffff", tree_cons("gg"), tree_cons("hhh")));
+    document doc = tree2doc(tree);
+
+    auto responsive = doc.responsive(80);
+    std::vector<int> breaks = responsive.breakpoints(1, 80);
+    CHECK( !breaks.empty() );
+    CHECK( breaks.size() < 10 );
+    CHECK( std::is_sorted(breaks.begin(), breaks.end()) );
+
+    for (int width = 1; width <= 80; ++width) {
+        std::ostringstream out;
+        no_annotation_renderer<> renderer(out);
+        responsive.at(width).replay(renderer);
+        CHECK( out.str() == render_string(doc, width) );
+
+        auto interval = responsive.interval(width);
+        CHECK( interval.first <= width );
+        CHECK( width < interval.second );
+        CHECK( render_string(doc, interval.first) == out.str() );
+        CHECK( render_string(doc, interval.second - 1) == out.str() );
+        if (interval.second <= 80)
+            CHECK( render_string(doc, interval.second) != out.str() );
+    }
+
+    // Everything fits flat from the last breakpoint on.
+    CHECK( responsive.interval(breaks.back()).second == INT_MAX );
+    CHECK( responsive.interval(1000).first == breaks.back() );
+}
+
+TEST_CASE("incremental layout")
+{
+    auto call = [](const std::string& name, int args) {
+        document result;
+        for (int i = 0; i < args; ++i)
+            result = result.move()
+                    .append(document::text(i ? "," : ""))
+                    .append(i ? document::line() : document())
+                    .append(document::text("arg" + std::to_string(i)));
+        return document::text(name + "(")
+                .append(result.move().align())
+                .append(document::text(")"))
+                .group();
+    };
+
+    incremental_layout items(20);
+    CHECK( items.lines() == 0 );
+
+    CHECK( items.insert(0, call("f", 2)).inserted == 1 );
+    CHECK( items.insert(1, call("g", 4)).inserted == 4 );
+    CHECK( items.insert(2, call("h", 1)).first == 5 );
+    CHECK( items.size() == 3 );
+    CHECK( items.lines() == 6 );
+
+    auto render_all = [&] {
+        std::ostringstream out;
+        no_annotation_renderer<> renderer(out);
+        items.render(renderer);
+        return out.str();
+    };
+
+    CHECK( render_all() == "f(arg0, arg1)\n"
+                           "g(arg0,\n  arg1,\n  arg2,\n  arg3)\n"
+                           "h(arg0)" );
+
+    line_change change = items.replace(1, call("g", 1));
+    CHECK( change.first == 1 );
+    CHECK( change.removed == 4 );
+    CHECK( change.inserted == 1 );
+    CHECK( render_all() == "f(arg0, arg1)\ng(arg0)\nh(arg0)" );
+
+    change = items.erase(0);
+    CHECK( change.first == 0 );
+    CHECK( change.removed == 1 );
+    CHECK( items.first_line(1) == 1 );
+    CHECK( render_all() == "g(arg0)\nh(arg0)" );
+
+    // Line numbers stay right through many edits.
+    incremental_layout many(20);
+    std::vector<size_t> counts;
+    auto lines_of = [&](const document& doc) { return doc.layout(20).lines(); };
+    for (int i = 0; i < 100; ++i) {
+        size_t at = size_t(i * 7) % (counts.size() + 1);
+        many.insert(at, call("f", i % 5));
+        counts.insert(counts.begin() + long(at), lines_of(call("f", i % 5)));
+    }
+    for (int i = 0; i < 50; ++i) {
+        size_t at = size_t(i * 13) % counts.size();
+        if (i % 3) {
+            many.replace(at, call("g", i % 4));
+            counts[at] = lines_of(call("g", i % 4));
+        } else {
+            many.erase(at);
+            counts.erase(counts.begin() + long(at));
+        }
+    }
+
+    size_t line = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        CHECK( many.first_line(i) == line );
+        line += counts[i];
+    }
+    CHECK( many.lines() == line );
+}
+
+TEST_CASE("range rendering")
+{
+    // a = 1;
+    // bb = call(x, y);
+    // c = 3;
+    document args = document::text("x").with_span(17, 18)
+            .append(document::text(","))
+            .append(document::line())
+            .append(document::text("y").with_span(20, 21));
+    document doc = document::text("a = 1;").with_span(0, 6)
+            .append(document::line())
+            .append(document::text("bb = call(")
+                            .append(args.move().nest(2))
+                            .append(document::text(");"))
+                            .group()
+                            .with_span(7, 23))
+            .append(document::line())
+            .append(document::text("c = 3;").with_span(24, 30));
+
+    auto range = [&](int width, size_t begin, size_t end,
+                     std::pair<size_t, size_t> covered) {
+        std::ostringstream out;
+        no_annotation_renderer<> renderer(out);
+        CHECK( doc.render_range(renderer, width, begin, end) == covered );
+        return out.str();
+    };
+
+    CHECK( range(80, 24, 25, {24, 30}) == "c = 3;" );
+    CHECK( range(80, 0, 30, {0, 30}) == render_string(doc, 80) );
+    CHECK( range(80, 31, 40, {0, 0}) == "" );
+    CHECK( range(80, 20, 21, {7, 23}) == "bb = call(x, y);" );
+    CHECK( range(12, 20, 21, {7, 23}) == "bb = call(x,\n  y);" );
+    CHECK( range(12, 17, 25, {7, 30}) == "bb = call(x,\n  y);\nc = 3;" );
+}
+
+TEST_CASE("layout replay of line ranges")
+{
+    annotated doc = annotated::text("one")
+            .append(annotated::line())
+            .append(annotated::text("two")
+                            .append(annotated::line())
+                            .append(annotated::text("three"))
+                            .nest(2)
+                            .annotate("<", ">"));
+    auto layout = doc.layout(80);
+    CHECK( layout.lines() == 3 );
+
+    auto lines = [&](size_t first, size_t count) {
+        std::ostringstream out;
+        simple_annotation_renderer<std::string> renderer(out);
+        layout.replay(renderer, first, count);
+        return out.str();
+    };
+
+    CHECK( lines(0, 3) == render_annotated(doc, 80) );
+    CHECK( lines(0, 1) == "one" );
+    CHECK( lines(1, 1) == "<two>" );
+    CHECK( lines(2, 5) == "<  three>" );
+}
+
+TEST_CASE("span recording renderer")
+{
+    using tagged = annotated_document<int>;
+    tagged doc = tagged::text("call(")
+            .append(tagged::text("x").annotate(1)
+                            .append(tagged::text(","))
+                            .append(tagged::line())
+                            .append(tagged::text("y").annotate(2))
+                            .nest(2)
+                            .annotate(3))
+            .append(tagged::text(")"))
+            .group();
+
+    span_recording_renderer<int> renderer(64, 8);
+    doc.render(renderer, 4);
+
+    CHECK( renderer.text() == "call(x,\n  y)" );
+
+    const auto& spans = renderer.spans();
+    REQUIRE( spans.size() == 3 );
+    CHECK( spans[0].annot == 3 );
+    CHECK( spans[0].begin == 5 );
+    CHECK( spans[0].end == 11 );
+    CHECK( spans[1].annot == 1 );
+    CHECK( renderer.text().substr(spans[1].begin,
+                                  spans[1].end - spans[1].begin) == "x" );
+    CHECK( spans[2].annot == 2 );
+    CHECK( renderer.text().substr(spans[2].begin,
+                                  spans[2].end - spans[2].begin) == "y" );
+
+    renderer.clear();
+    doc.render(renderer, 80);
+    CHECK( renderer.text() == "call(x, y)" );
+    CHECK( renderer.spans().size() == 3 );
+}
+
+TEST_CASE("source maps")
+{
+    document call = document::text("f(")
+            .append(document::text("a").with_source(2)
+                            .append(document::text(","))
+                            .append(document::line())
+                            .append(document::text("b").with_source(3))
+                            .nest(2))
+            .append(document::text(")"))
+            .group()
+            .with_source(1);
+    document doc = document::text("x = ")
+            .append(call.move())
+            .append(document::text(";"));
+
+    std::ostringstream out;
+    no_annotation_renderer<> renderer(out);
+    source_map map;
+    doc.render(renderer, 80, map);
+
+    CHECK( out.str() == "x = f(a, b);" );
+    CHECK( map.mappings() == "IC,EC,CD,EE,CF,C" );
+    CHECK( !map.find(0, 0) );
+    CHECK( map.find(0, 4) == 1u );
+    CHECK( map.find(0, 6) == 2u );
+    CHECK( map.find(0, 8) == 1u );
+    CHECK( map.find(0, 9) == 3u );
+    CHECK( !map.find(0, 11) );
+
+    out.str("");
+    map.clear();
+    doc.render(renderer, 8, map);
+
+    CHECK( out.str() == "x = f(a,\n  b);" );
+    CHECK( map.find(0, 6) == 2u );
+    CHECK( !map.find(1, 0) );
+    CHECK( map.find(1, 2) == 3u );
+    CHECK( map.find(1, 3) == 1u );
+    CHECK( !map.find(1, 4) );
+    CHECK( !map.find(2, 0) );
+}
+
+TEST_CASE("ansi renderer")
+{
+    using styled = annotated_document<ansi_style>;
+
+    ansi_style red, bold, highlight;
+    red.foreground = 1;
+    bold.bold = true;
+    highlight.background = 4;
+
+    auto render_ansi = [](const styled& doc) {
+        std::ostringstream out;
+        ansi_renderer<> renderer(out);
+        doc.render(renderer, 80);
+        renderer.finish();
+        return out.str();
+    };
+
+    // Adjacent and nested runs in the same style, and the space between
+    // them, need no escapes.
+    CHECK( render_ansi(styled::text("a").annotate(red)
+                               .append(styled::text(" "))
+                               .append(styled::text("b").annotate(red)
+                                               .annotate(red)))
+           == "\x1b[31ma b\x1b[39m" );
+
+    CHECK( render_ansi(styled::text("a")
+                               .append(styled::text("b").annotate(bold))
+                               .append(styled::text("c"))
+                               .annotate(red))
+           == "\x1b[31ma\x1b[1mb\x1b[22mc\x1b[39m" );
+
+    CHECK( render_ansi(styled::text("x").annotate(highlight)
+                               .append(styled::line())
+                               .append(styled::text("y")))
+           == "\x1b[44mx\x1b[49m\ny" );
+
+    ansi_style gray;
+    gray.foreground = 244;
+    CHECK( render_ansi(styled::text("z").annotate(gray))
+           == "\x1b[38;5;244mz\x1b[39m" );
+}
+
+TEST_CASE("html renderer")
+{
+    using classed = annotated_document<std::string>;
+
+    classed doc = classed::text("if")
+            .annotate("kw")
+            .append(classed::text(" (a < b && c > \"d\")"))
+            .append(classed::line())
+            .append(classed::text("x").annotate("var\"<"))
+            .nest(2);
+
+    std::ostringstream out;
+    html_renderer<> renderer(out);
+    doc.render(renderer, 80);
+
+    CHECK( out.str() == "<span class=\"kw\">if</span>"
+                        " (a &lt; b &amp;&amp; c &gt; &quot;d&quot;)\n"
+                        "  <span class=\"var&quot;&lt;\">x</span>" );
+
+    // Specials at every position relative to the scan's blocks.
+    for (size_t length = 0; length < 40; ++length) {
+        for (size_t at = 0; at < length; ++at) {
+            std::string text(length, 'a');
+            text[at] = '&';
+            if (at + 3 < length) text[at + 3] = '"';
+
+            std::string expected;
+            for (char c : text)
+                expected += c == '&' ? "&amp;" : c == '"' ? "&quot;"
+                                                          : std::string(1, c);
+
+            string_output escaped;
+            html_renderer<string_output> escaper(escaped);
+            escaper.write(text);
+            CHECK( escaped.str == expected );
+        }
+    }
+}
+
+TEST_CASE("escaped string literals")
+{
+    std::string raw = "say \"hi\"\\\n\t\x01\x7f\xc3\xa9";
+    document c = document::escaped(raw);
+    document json = document::escaped(raw, escape_style::json);
+
+    CHECK( render_string(c, 80)
+           == "\"say \\\"hi\\\"\\\\\\n\\t\\001\\177\xc3\xa9\"" );
+    CHECK( render_string(json, 80)
+           == "\"say \\\"hi\\\"\\\\\\n\\t\\u0001\x7f\xc3\xa9\"" );
+
+    // The precomputed width drives layout.
+    std::string long_text(30, 'x');
+    long_text[20] = '\n';
+    document doc = document::text("f(")
+            .append(document::line(true))
+            .append(document::escaped(long_text))
+            .append(document::text(")"))
+            .nest(2)
+            .group();
+    CHECK( render_string(doc, 35) == "f(\n  \"" + std::string(20, 'x') +
+                                     "\\n" + std::string(9, 'x') + "\")" );
+    CHECK( render_string(doc, 36) == "f(\"" + std::string(20, 'x') +
+                                     "\\n" + std::string(9, 'x') + "\")" );
+
+    // Escapes at every position relative to the scan's blocks.
+    for (size_t length = 0; length < 40; ++length) {
+        for (size_t at = 0; at < length; ++at) {
+            std::string text(length, 'a');
+            text[at] = '\x1f';
+
+            std::string expected = "\"" + text.substr(0, at) + "\\037" +
+                                   text.substr(at + 1) + "\"";
+            CHECK( render_string(document::escaped(text), 80) == expected );
+        }
+    }
+}
+
+TEST_CASE("numbers")
+{
+    CHECK( render_string(document::number(0), 80) == "0" );
+    CHECK( render_string(document::number(-42), 80) == "-42" );
+    CHECK( render_string(document::number(INT64_MIN), 80)
+           == "-9223372036854775808" );
+    CHECK( render_string(document::number(UINT64_MAX), 80)
+           == "18446744073709551615" );
+    CHECK( render_string(document::number(255u, 16), 80) == "ff" );
+    CHECK( render_string(document::number(UINT64_MAX, 2), 80)
+           == std::string(64, '1') );
+
+    CHECK( render_string(document::number(0.1), 80) == "0.1" );
+    CHECK( render_string(document::number(1e300), 80) == "1e+300" );
+    CHECK( render_string(document::number(1.5, std::chars_format::fixed, 3),
+                         80) == "1.500" );
+    CHECK( render_string(document::number(1e30, std::chars_format::fixed), 80)
+           == "1000000000000000019884624838656" );
+
+    // Numbers are measured for layout like text.
+    document doc = document::number(12345)
+            .append(document::line())
+            .append(document::number(-6.25))
+            .group();
+    CHECK( render_string(doc, 11) == "12345 -6.25" );
+    CHECK( render_string(doc, 10) == "12345\n-6.25" );
+
+    counting_resource counter;
+    {
+        memory_resource_scope scope(&counter);
+        document n = document::number(123456789);
+        CHECK( counter.allocated == 1 );
+    }
+}
+
+TEST_CASE("text literals and shared documents")
+{
+    using namespace pretty::literals;
+
+    constexpr text_literal comma = ","_doc;
+    static_assert(comma.size == 1);
+    static_assert("hello"_doc.size == 5);
+
+    static const document open = document::constant("["_doc),
+                          close = document::constant("]"_doc),
+                          sep = document::constant(comma);
+
+    auto list = [&](int n) {
+        document items;
+        for (int i = 0; i < n; ++i) {
+            if (i > 0) items = items.move()
+                    .append(sep.share())
+                    .append(document::line());
+            items = items.move().append(document::number(i));
+        }
+        return open.share()
+                .append(items.move().nest(1))
+                .append(close.share())
+                .group();
+    };
+
+    CHECK( render_string(list(3), 80) == "[0, 1, 2]" );
+    CHECK( render_string(list(3), 5) == "[0,\n 1,\n 2]" );
+
+    counting_resource counter;
+    {
+        memory_resource_scope scope(&counter);
+        document shared = open.share();
+        document copy = shared;
+        CHECK( counter.allocated == 0 );
+        CHECK( render_string(copy, 80) == "[" );
+    }
+
+    // A constant first made inside a short-lived arena lives outside it.
+    {
+        counting_resource arena;
+        memory_resource_scope scope(&arena);
+        static const document semi = document::constant(
+                document(";"_doc).append(document::line()).group());
+        CHECK( arena.live == 0 );
+        CHECK( render_string(semi.share(), 80) == "; " );
+    }
+
+    // Copying whole documents copies their own nodes but shares the
+    // shared ones.
+    document doc = list(2);
+    document copy = doc;
+    doc = document();
+    CHECK( render_string(copy, 80) == "[0, 1]" );
+}
+
+TEST_CASE("fragments")
+{
+    using namespace pretty::literals;
+    namespace f = pretty::fragments;
+
+    constexpr auto pair = f::group("(a,"_doc + f::line + "b)"_doc);
+    static_assert(pair.literal_width() == 6);
+    static_assert(decltype(pair)::nodes == 6);
+
+    CHECK( render_string(f::lower(pair), 80) == "(a, b)" );
+    CHECK( render_string(f::lower(pair), 5) == "(a,\nb)" );
+
+    document args = document::text("x")
+            .append(document::text(","))
+            .append(document::line())
+            .append(document::text("y"));
+    auto call = f::group("f("_doc + f::nest(2, f::line_break + f::ref(args))
+                         + f::line_break + ")"_doc);
+    // `ref`s and `view`s have no literal width.
+    CHECK( call.literal_width() == 3 );
+
+    auto direct = [&](int width) {
+        std::ostringstream out;
+        no_annotation_renderer<> renderer(out);
+        f::render(call, renderer, width);
+        return out.str();
+    };
+
+    CHECK( direct(80) == "f(x, y)" );
+    CHECK( direct(80) == render_string(f::lower(call), 80) );
+    CHECK( direct(4) == "f(\n  x,\n  y\n)" );
+
+    // Direct rendering lowers into the stack.
+    counting_resource counter;
+    {
+        memory_resource_scope scope(&counter);
+        direct(80);
+        direct(4);
+    }
+    CHECK( counter.allocated == 0 );
+
+    std::string name = "g";
+    CHECK( render_string(f::lower(f::view(name) + "()"_doc), 80) == "g()" );
+
+    // Adjacent literals fold into one text node of their combined width.
+    auto run = f::group("ab"_doc + "cd"_doc + f::line + "e"_doc + "f"_doc);
+    CHECK( render_string(f::lower(run), 7) == "abcd ef" );
+    CHECK( render_string(f::lower(run), 6) == "abcd\nef" );
+
+    counting_resource folded;
+    {
+        memory_resource_scope scope(&folded);
+        document doc = f::lower("a"_doc + "b"_doc + "c"_doc + "d"_doc);
+        CHECK( render_string(doc, 80) == "abcd" );
+        CHECK( folded.live == 1 );  // one text node, short string inline
+    }
+}
+
+TEST_CASE("render cancellation")
+{
+    std::atomic<bool> cancel {false};
+    render_options options;
+    options.cancel = &cancel;
+    options.check_interval = 16;
+    options.max_lines = 3;
+    CHECK( render_limited(lazy_forever(0), 80, options,
+                          render_status::truncated)
+           == "0\n1\n2..." );
+    options.max_lines = SIZE_MAX;
+
+    cancel = true;
+    std::string partial = render_limited(lazy_forever(0), 80, options,
+                                         render_status::cancelled);
+    CHECK( partial.size() > 3 );
+    CHECK( partial.substr(partial.size() - 3) == "..." );
+
+    // Lookahead that would never end is interrupted too.
+    CHECK( render_limited(lazy_forever(0).group(), INT_MAX, options,
+                          render_status::cancelled)
+           == "..." );
+
+    render_options late;
+    late.deadline = std::chrono::steady_clock::now();
+    CHECK( render_limited(lazy_forever(0).group(), INT_MAX, late,
+                          render_status::cancelled)
+           == "..." );
+}
+
+// A list of `depth` nested elidable lists: [1, [2, [3]]].
+document nested_lists(int from, int depth, int* forced)
+{
+    document items = document::text(std::to_string(from));
+    if (depth > 1)
+        items = items.move()
+                .append(document::text(","))
+                .append(document::line())
+                .append(document::lazy([=] {
+                    ++*forced;
+                    return nested_lists(from + 1, depth - 1, forced);
+                }));
+
+    return document::text("[")
+            .append(items.move().nest(1))
+            .append(document::text("]"))
+            .group()
+            .elidable(document::text("[...]"));
+}
+
+TEST_CASE("elision")
+{
+    int forced = 0;
+    document lists = nested_lists(1, 4, &forced);
+
+    CHECK( render_limited(lists, 80, {}, render_status::complete)
+           == "[1, [2, [3, [4]]]]" );
+    CHECK( forced == 3 );
+
+    render_options depth;
+    depth.max_depth = 2;
+    forced = 0;
+    CHECK( render_limited(lists, 80, depth, render_status::complete)
+           == "[1, [2, [...]]]" );
+    CHECK( forced == 2 );
+
+    depth.max_depth = 0;
+    forced = 0;
+    CHECK( render_limited(lists, 80, depth, render_status::complete)
+           == "[...]" );
+    CHECK( forced == 0 );
+
+    // Measuring forces only as far as the budget reaches.
+    render_options wide;
+    wide.max_flat_width = 10;
+    forced = 0;
+    CHECK( render_limited(lists, 80, wide, render_status::complete)
+           == "[...]" );
+    CHECK( forced == 2 );
+
+    document small = document::text("[")
+            .append(document::lazy([&] {
+                ++forced;
+                return document::text("1");
+            }))
+            .append(document::text("]"))
+            .elidable(document::text("[...]"));
+    forced = 0;
+    CHECK( render_limited(small, 80, wide, render_status::complete)
+           == "[1]" );
+    CHECK( forced == 1 );
+
+    // What was forced to measure an elided document is dropped, and the
+    // rest of the render goes on as usual.
+    wide.max_flat_width = 2;
+    forced = 0;
+    CHECK( render_limited(small.share().append(lists.share()), 80, wide,
+                          render_status::complete) == "[...][...]" );
+    CHECK( forced == 1 );
+}
+
+TEST_CASE("elision depth in lookahead")
+{
+    // Looking ahead from inside `a` to `b`, which follows it, must judge
+    // `b` at its own depth, not at the depth of `a`'s contents.
+    document a = document::text("aaaa")
+            .append(document::line())
+            .append(document::text("bbbb"))
+            .group()
+            .elidable(document::text("?"));
+    document b = document::text(std::string(20, 'x'))
+            .elidable(document::text("."));
+    document doc = a.move().append(b.move());
+
+    render_options depth;
+    depth.max_depth = 1;
+    std::string expected = "aaaa\nbbbb" + std::string(20, 'x');
+    CHECK( render_limited(doc, 25, depth, render_status::complete)
+           == expected );
+    CHECK( render_limited(doc, 25, {}, render_status::complete)
+           == expected );
+}
+
+TEST_CASE("elision by width")
+{
+    document wide = document::text("[").append(document::text(std::string(20, 'x')))
+            .append(document::text("]"))
+            .elidable(document::text("[...]"));
+    document doc = document::text("short:")
+            .append(document::line())
+            .append(document::text("[1]").elidable(document::text("[...]")))
+            .append(document::line())
+            .append(document::text("long:"))
+            .append(document::line())
+            .append(wide.move())
+            .group();
+
+    render_options options;
+    options.max_flat_width = 10;
+    CHECK( render_limited(doc, 80, options, render_status::complete)
+           == "short: [1] long: [...]" );
+    CHECK( render_limited(doc, 80, {}, render_status::complete)
+           == "short: [1] long: [xxxxxxxxxxxxxxxxxxxx]" );
+}
+
+std::vector<std::string> split_lines(const std::string& s)
+{
+    std::vector<std::string> result(1);
+    for (char c : s) {
+        if (c == '\n') result.emplace_back();
+        else result.back() += c;
+    }
+    return result;
+}
+
+std::string join_lines(const std::vector<std::string>& lines,
+                       size_t first, size_t count)
+{
+    std::string result;
+    for (size_t i = first; i < std::min(lines.size(), first + count); ++i) {
+        if (i > first) result += '\n';
+        result += lines[i];
+    }
+    return result;
+}
+
+TEST_CASE("line index")
+{
+    std::string input = "[";
+    for (int i = 0; i < 40; ++i) {
+        if (i > 0) input += ", ";
+        input += "{\"id\": " + std::to_string(i) + ", \"tags\": [1, 2, 3]}";
+    }
+    input += "]";
+
+    json_options options;
+    options.lazy = false;
+    document doc = json_document(input, options);
+
+    std::vector<std::string> lines = split_lines(render_string(doc, 20));
+    auto index = doc.index_lines(20, 7);
+    CHECK( index.lines() == lines.size() );
+
+    for (size_t first : {0, 1, 6, 7, 8, 50, 100, 239, 240}) {
+        for (size_t count : {1, 3, 20}) {
+            std::ostringstream out;
+            no_annotation_renderer<> renderer(out);
+            index.render(renderer, first, count);
+            CHECK( out.str() == join_lines(lines, first, count) );
+        }
+    }
+}
+
+TEST_CASE("line index annotations")
+{
+    annotated doc = annotated::text("a")
+            .append(annotated::line())
+            .append(annotated::text("b")
+                            .append(annotated::line())
+                            .append(annotated::text("c").annotate("<", ">"))
+                            .append(annotated::line())
+                            .append(annotated::text("d"))
+                            .nest(2)
+                            .annotate("[", "]"))
+            .append(annotated::line())
+            .append(annotated::text("e"));
+
+    CHECK( render_annotated(doc, 80) == "a\n[b\n  <c>\n  d]\ne" );
+
+    auto index = doc.index_lines(80, 2);
+    std::ostringstream out;
+    simple_annotation_renderer<std::string> renderer(out);
+    index.render(renderer, 2, 2);
+    CHECK( out.str() == "[  <c>\n  d]" );
+}